@@ -21,13 +21,18 @@
  */
 
 #include <stdio.h>
+#include <inttypes.h>
 #include <string.h>
 #include <stdlib.h>
 
 #include <RP2040.h>
+#include <hardware/clocks.h>
 #include <hardware/flash.h>
 #include <hardware/resets.h>
+#include <hardware/structs/ssi.h>
 #include <hardware/sync.h>
+#include <hardware/uart.h>
+#include <hardware/vreg.h>
 #include <hardware/watchdog.h>
 #include <pico/stdlib.h>
 #include "pico/unique_id.h"
@@ -47,11 +52,14 @@
 #define LED_PIN 14
 
 
+// Takes a printf() format string literal. Busy-waits for the UART to drain, so
+// it can be used with interrupts disabled, e.g. in the middle of a swap.
 #ifdef PFB_WITH_BOOTLOADER_LOGS
-#    define BOOTLOADER_LOG(...)                \
-        do {                                   \
-            puts("[BOOTLOADER] " __VA_ARGS__); \
-            sleep_ms(5);                       \
+#    define BOOTLOADER_LOG(...)                  \
+        do {                                     \
+            printf("[BOOTLOADER] " __VA_ARGS__); \
+            putchar('\n');                       \
+            busy_wait_ms(5);                     \
         } while (0)
 #else // PFB_WITH_BOOTLOADER_LOGS
 #    define BOOTLOADER_LOG(...) ((void) 0)
@@ -63,49 +71,464 @@ void _pfb_mark_is_after_rollback(void);
 void _pfb_mark_is_not_after_rollback(void);
 bool _pfb_should_rollback(void);
 void _pfb_mark_should_rollback(void);
+uint32_t _pfb_boot_attempts(void);
+void _pfb_mark_boot_attempts(uint32_t attempts);
 bool _pfb_has_firmware_to_swap(void);
 uint32_t _pfb_firmware_swap_size(void);
+bool _pfb_should_install_by_copy(void);
+void _pfb_publish_boot_timings(const pfb_boot_timings_t *timings);
+bool _pfb_is_recovery_requested(void);
+void _pfb_clear_recovery_request(void);
+bool _pfb_is_info_unchanged(void);
+pfb_boot_reason_t _pfb_boot_reason(void);
+void _pfb_publish_boot_status(pfb_boot_reason_t reason, bool is_info_unchanged);
+uint32_t _pfb_read_flash_jedec_id(void);
+uint32_t _pfb_app_partition_start(void);
+uint32_t _pfb_download_partition_start(void);
+uint32_t _pfb_swap_max_length(void);
+uint32_t _pfb_swap_scratch_start(void);
+bool _pfb_is_layout_in_flash(void);
+void _pfb_flash_range_erase(uint32_t addr_with_xip_offset, size_t len);
+void _pfb_erase_counters_flush(void);
+void _pfb_boot_history_append(pfb_boot_reason_t reason,
+                              pfb_boot_action_t action,
+                              uint32_t duration_us);
 
-static void swap_images(void) {
-    uint8_t swap_buff_from_downlaod_slot[FLASH_SECTOR_SIZE];
-    uint8_t swap_buff_from_application_slot[FLASH_SECTOR_SIZE];
+static pfb_boot_timings_t boot_timings;
+static pfb_boot_reason_t boot_reason;
+static bool is_info_unchanged;
+static pfb_boot_action_t boot_action = PFB_BOOT_ACTION_NONE;
+
+static uint32_t get_elapsed_us(uint64_t start_us) {
+    return (uint32_t) (time_us_64() - start_us);
+}
+
+#ifdef PFB_WITH_DIRECT_XIP
+uint32_t _pfb_download_slot_start(void);
+uint32_t _pfb_active_slot_start(void);
+void _pfb_activate_download_slot(void);
+void _pfb_invalidate_active_slot(void);
+
+/**
+ * Images are executed in place, so an image may only be activated if it was
+ * linked for the slot it has been downloaded into, i.e. its reset handler
+ * points into that slot.
+ */
+static bool image_is_linked_for_download_slot(void) {
+    uint32_t slot_start = _pfb_download_slot_start();
+    uint32_t reset_vector = *(volatile uint32_t *) (slot_start + 0x04);
+
+    return reset_vector >= slot_start
+           && reset_vector
+                      < slot_start + _pfb_swap_max_length();
+}
+#else // PFB_WITH_DIRECT_XIP
+
+/**
+ * Images are swapped in batches of up to SWAP_BATCH_SIZE bytes, staged in RAM.
+ * Slots start on block boundaries and are a whole number of blocks long, so
+ * batches are aligned to the flash blocks of both slots and of the scratch
+ * area. A block which has changed considerably is rewritten using a single 64k
+ * block erase instead of 16 sector erases, in all three writes of a batch. Only
+ * the last batch may be shorter, and it's handled sector by sector.
+ *
+ * Every batch which differs between the slots is swapped in three steps, each
+ * of them recorded in the swap journal once it's done:
+ *  - the application batch is saved in the scratch area,
+ *  - the download batch is written into the application slot,
+ *  - the saved application batch is written into the download slot.
+ * Identical batches are recorded as done right away. At any point both batches
+ * are available in flash, so an interrupted swap can be resumed from the last
+ * journal entry, or from the one before it if the last one has been torn by
+ * a power loss. Only sectors which differ from the data staged in RAM are
+ * rewritten, which also makes every step idempotent.
+ */
+#define SWAP_BATCH_SIZE FLASH_BLOCK_SIZE
+#define SWAP_BLOCK_ERASE_MIN_SECTORS 4
+#define SWAP_PROGRAM_RETRIES 3
+
+// None of the stages has all the bits of another one set, so an entry torn by
+// a power loss, which keeps some of the bits of the erased flash, never looks
+// like an entry of another stage.
+#define SWAP_STAGE_SCRATCH_SAVED 0x3
+#define SWAP_STAGE_APP_WRITTEN 0x5
+#define SWAP_STAGE_BATCH_DONE 0x6
+
+void _pfb_swap_journal_begin(uint32_t entry_count);
+void _pfb_swap_journal_record(uint32_t sector, uint32_t stage);
+int _pfb_swap_journal_last(uint32_t *out_sector,
+                           uint32_t *out_stage,
+                           bool (*is_next_entry)(uint32_t prev_sector,
+                                                 uint32_t prev_stage,
+                                                 uint32_t sector,
+                                                 uint32_t stage));
+void _pfb_flash_read(uint32_t addr, void *dest, size_t len);
+bool _pfb_flash_read_crc32(uint32_t addr,
+                           void *dest,
+                           size_t len,
+                           uint32_t *out_crc);
+void _pfb_crc_table_invalidate(uint32_t slot_start);
+int _pfb_crc_table_store(uint32_t slot_start,
+                         uint32_t size,
+                         uint32_t install_timestamp);
+uint32_t _pfb_image_install_timestamp(uint32_t slot_start);
+
+// Slots are read through the XIP stream into these buffers, so swapping
+// doesn't thrash the XIP cache the bootloader is executed from.
+static uint32_t swap_buff_from_downlaod_slot[SWAP_BATCH_SIZE / sizeof(uint32_t)];
+static uint32_t swap_buff_from_application_slot[SWAP_BATCH_SIZE / sizeof(uint32_t)];
+static uint32_t swap_buff_sector[FLASH_SECTOR_SIZE / sizeof(uint32_t)];
+// CRC32 of every sector of the batches above, calculated by the DMA sniffer
+// while the batches are read and used to verify them once they're written.
+static uint32_t swap_crcs_from_download_slot[SWAP_BATCH_SIZE / FLASH_SECTOR_SIZE];
+static uint32_t swap_crcs_from_application_slot[SWAP_BATCH_SIZE / FLASH_SECTOR_SIZE];
+
+static uint32_t get_swap_batch_length(uint32_t offset, uint32_t swap_size) {
+    uint32_t app_addr_with_xip_offset =
+            _pfb_app_partition_start() - XIP_BASE + offset;
+    uint32_t len = SWAP_BATCH_SIZE - app_addr_with_xip_offset % SWAP_BATCH_SIZE;
+
+    return len < swap_size - offset ? len : swap_size - offset;
+}
+
+static uint32_t get_swap_size(void) {
     uint32_t swap_size = _pfb_firmware_swap_size();
-    if (swap_size == 0 || swap_size > PFB_ADDR_AS_U32(__FLASH_SWAP_SPACE_LENGTH)) swap_size = PFB_ADDR_AS_U32(__FLASH_SWAP_SPACE_LENGTH);
+    if (swap_size == 0 || swap_size > _pfb_swap_max_length()) swap_size = _pfb_swap_max_length();
+    return swap_size;
+}
+
+/**
+ * Returns true if the journal entry of @p stage recorded for the batch starting
+ * at @p sector is the one which follows the entry of @p prev_stage recorded for
+ * @p prev_sector, i.e. the next stage of the same batch, or the first entry of
+ * the next batch. @p prev_stage is 0 before the first entry of a swap. Batches
+ * are always recorded, identical ones as done right away, so every entry has
+ * a single possible successor in each stage and a torn entry is never accepted.
+ */
+static bool is_next_journal_entry(uint32_t prev_sector,
+                                  uint32_t prev_stage,
+                                  uint32_t sector,
+                                  uint32_t stage) {
+    uint32_t swap_size = get_swap_size();
+    uint32_t prev_offset = prev_sector * FLASH_SECTOR_SIZE;
+    switch (prev_stage) {
+    case SWAP_STAGE_SCRATCH_SAVED:
+        return sector == prev_sector && stage == SWAP_STAGE_APP_WRITTEN;
+    case SWAP_STAGE_APP_WRITTEN:
+        return sector == prev_sector && stage == SWAP_STAGE_BATCH_DONE;
+    case SWAP_STAGE_BATCH_DONE:
+        prev_offset += get_swap_batch_length(prev_offset, swap_size);
+        break;
+    case 0:
+        prev_offset = 0;
+        break;
+    default:
+        return false;
+    }
+    return prev_offset < swap_size
+           && sector * FLASH_SECTOR_SIZE == prev_offset
+           && (stage == SWAP_STAGE_SCRATCH_SAVED
+               || stage == SWAP_STAGE_BATCH_DONE);
+}
+
+static bool sector_matches(uint32_t addr_with_xip_offset, const uint8_t *data) {
+    _pfb_flash_read(XIP_BASE + addr_with_xip_offset, swap_buff_sector,
+                    FLASH_SECTOR_SIZE);
+    return memcmp(swap_buff_sector, data, FLASH_SECTOR_SIZE) == 0;
+}
+
+/**
+ * Returns true if the CRC32 of every sector has been stored in @p out_crcs.
+ */
+static bool read_batch(uint32_t addr_with_xip_offset,
+                       uint32_t *dest,
+                       uint32_t len,
+                       uint32_t *out_crcs) {
+    bool has_crcs = true;
+    for (uint32_t i = 0; i < len / FLASH_SECTOR_SIZE; i++) {
+        has_crcs &= _pfb_flash_read_crc32(
+                XIP_BASE + addr_with_xip_offset + i * FLASH_SECTOR_SIZE,
+                (uint8_t *) dest + i * FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE,
+                &out_crcs[i]);
+    }
+    return has_crcs;
+}
+
+static bool sector_is_written(uint32_t addr_with_xip_offset,
+                              const uint8_t *data,
+                              const uint32_t *expected_crc) {
+    uint32_t crc;
+    if (expected_crc
+        && _pfb_flash_read_crc32(XIP_BASE + addr_with_xip_offset, NULL,
+                                 FLASH_SECTOR_SIZE, &crc)) {
+        return crc == *expected_crc;
+    }
+    return sector_matches(addr_with_xip_offset, data);
+}
+
+/**
+ * Makes the flash at @p dest_addr_with_xip_offset hold @p len bytes of @p src.
+ * Sectors which already hold the expected data are left untouched. Rewritten
+ * sectors are verified against @p src_crcs, or against @p src if it's NULL,
+ * and erased and programmed again on a mismatch.
+ *
+ * Returns false if a sector still doesn't match after SWAP_PROGRAM_RETRIES.
+ */
+static bool write_batch(uint32_t dest_addr_with_xip_offset,
+                        const uint8_t *src,
+                        const uint32_t *src_crcs,
+                        uint32_t len) {
+    uint64_t start_us = time_us_64();
+    uint32_t sectors = len / FLASH_SECTOR_SIZE;
+    bool is_verified = true;
+    uint32_t differing_mask = 0;
+    uint32_t differing_count = 0;
+
+    for (uint32_t i = 0; i < sectors; i++) {
+        if (!sector_matches(dest_addr_with_xip_offset + i * FLASH_SECTOR_SIZE,
+                            src + i * FLASH_SECTOR_SIZE)) {
+            differing_mask |= 1u << i;
+            differing_count++;
+        }
+    }
+
+    if (len == FLASH_BLOCK_SIZE
+        && dest_addr_with_xip_offset % FLASH_BLOCK_SIZE == 0
+        && differing_count >= SWAP_BLOCK_ERASE_MIN_SECTORS) {
+        _pfb_flash_range_erase(dest_addr_with_xip_offset, len);
+        flash_range_program(dest_addr_with_xip_offset, src, len);
+        // Every sector of the block has been rewritten.
+        differing_mask = (1u << sectors) - 1;
+    } else {
+        for (uint32_t i = 0; i < sectors; i++) {
+            if (differing_mask & (1u << i)) {
+                _pfb_flash_range_erase(dest_addr_with_xip_offset
+                                               + i * FLASH_SECTOR_SIZE,
+                                       FLASH_SECTOR_SIZE);
+                flash_range_program(dest_addr_with_xip_offset
+                                            + i * FLASH_SECTOR_SIZE,
+                                    src + i * FLASH_SECTOR_SIZE,
+                                    FLASH_SECTOR_SIZE);
+            }
+        }
+    }
+
+    for (uint32_t i = 0; is_verified && i < sectors; i++) {
+        if (!(differing_mask & (1u << i))) {
+            continue;
+        }
+        uint32_t sector_addr = dest_addr_with_xip_offset + i * FLASH_SECTOR_SIZE;
+        const uint8_t *sector_src = src + i * FLASH_SECTOR_SIZE;
+        const uint32_t *sector_crc = src_crcs ? &src_crcs[i] : NULL;
+        for (uint32_t retry = 0;
+             !sector_is_written(sector_addr, sector_src, sector_crc); retry++) {
+            if (retry == SWAP_PROGRAM_RETRIES) {
+                BOOTLOADER_LOG("Sector at 0x%08" PRIx32 " failed verification",
+                               sector_addr);
+                is_verified = false;
+                break;
+            }
+            _pfb_flash_range_erase(sector_addr, FLASH_SECTOR_SIZE);
+            flash_range_program(sector_addr, sector_src, FLASH_SECTOR_SIZE);
+        }
+    }
+
+    uint32_t batch_us = get_elapsed_us(start_us);
+    boot_timings.batch_count++;
+    boot_timings.batch_total_us += batch_us;
+    if (batch_us > boot_timings.batch_max_us) {
+        boot_timings.batch_max_us = batch_us;
+    }
+    return is_verified;
+}
+
+/**
+ * Copies the download slot into the application slot, leaving the download
+ * slot untouched. Sectors which already hold the right data are skipped, so
+ * an interrupted copy is simply performed again.
+ *
+ * Returns 1 if a sector couldn't be verified, in which case the application
+ * slot is left without a CRC32 table and MUST NOT be booted, 0 otherwise.
+ */
+static int copy_image(void) {
+    uint32_t copy_size = get_swap_size();
+    printf("COPYING %ld bytes\n", copy_size);
+    boot_timings.install_size = copy_size;
+    _pfb_crc_table_invalidate(_pfb_app_partition_start());
+
+    uint32_t saved_interrupts = save_and_disable_interrupts();
+    for (uint32_t offset = 0; offset < copy_size;
+         offset += get_swap_batch_length(offset, copy_size)) {
+        uint32_t len = get_swap_batch_length(offset, copy_size);
+
+        gpio_put(LED_PIN, (offset / FLASH_SECTOR_SIZE) & 0x10);
+
+        bool has_crcs = read_batch(
+                _pfb_download_partition_start() - XIP_BASE + offset,
+                swap_buff_from_downlaod_slot, len,
+                swap_crcs_from_download_slot);
+        if (!write_batch(_pfb_app_partition_start() - XIP_BASE + offset,
+                         (uint8_t *) swap_buff_from_downlaod_slot,
+                         has_crcs ? swap_crcs_from_download_slot : NULL,
+                         len)) {
+            restore_interrupts(saved_interrupts);
+            printf("COPY FAILED\n");
+            return 1;
+        }
+    }
+    restore_interrupts(saved_interrupts);
+
+    uint64_t hash_start_us = time_us_64();
+    _pfb_crc_table_store(_pfb_app_partition_start(), copy_size,
+                         _pfb_image_install_timestamp(
+                                 _pfb_download_partition_start()));
+    boot_timings.hash_us += get_elapsed_us(hash_start_us);
+    printf("COPIED\n");
+    return 0;
+}
+
+/**
+ * Swaps the application and the download slots, resuming an interrupted swap
+ * from the swap journal.
+ *
+ * Returns 1 if a sector couldn't be verified. The failed stage is not
+ * recorded, so the swap is resumed from it on the next boot, and the slots
+ * MUST NOT be booted until then. Also returns 1 if the swap journal can't be
+ * trusted, as the swap can't be resumed then. Returns 0 otherwise.
+ */
+static int swap_images(void) {
+    uint32_t swap_size = get_swap_size();
     printf("SWAPPING %ld bytes\n",swap_size);
-    const uint32_t SWAP_ITERATIONS = swap_size / FLASH_SECTOR_SIZE;
+    boot_timings.install_size = swap_size;
+    // Install timestamps follow the images. They're lost if the swap is
+    // resumed, as the CRC32 tables have been invalidated by then.
+    uint32_t application_timestamp =
+            _pfb_image_install_timestamp(_pfb_app_partition_start());
+    uint32_t download_timestamp =
+            _pfb_image_install_timestamp(_pfb_download_partition_start());
+    uint32_t swapped_batches = 0;
+    uint32_t skipped_batches = 0;
+
+    uint32_t offset = 0;
+    uint32_t resume_stage = SWAP_STAGE_BATCH_DONE;
+    uint32_t journal_sector, journal_stage;
+    int journal_state = _pfb_swap_journal_last(&journal_sector, &journal_stage,
+                                               is_next_journal_entry);
+    if (journal_state < 0) {
+        // The slots may hold any mix of both images by now, swapping them
+        // again from the start would make it worse.
+        printf("SWAP JOURNAL CAN'T BE TRUSTED\n");
+        return 1;
+    } else if (journal_state > 0) {
+        printf("RESUMING SWAP AT SECTOR %ld STAGE %ld\n", journal_sector,
+               journal_stage);
+        offset = journal_sector * FLASH_SECTOR_SIZE;
+        if (journal_stage == SWAP_STAGE_BATCH_DONE) {
+            offset += get_swap_batch_length(offset, swap_size);
+        } else {
+            resume_stage = journal_stage;
+        }
+    } else {
+        // Three entries per batch, the first and the last one may be partial.
+        _pfb_swap_journal_begin(3 * (swap_size / SWAP_BATCH_SIZE + 2));
+    }
+
+    const uint32_t scratch = _pfb_swap_scratch_start() - XIP_BASE;
+
+    // Both slots change, so their CRC32 tables are stale until the swap ends.
+    _pfb_crc_table_invalidate(_pfb_app_partition_start());
+    _pfb_crc_table_invalidate(_pfb_download_partition_start());
 
     uint32_t saved_interrupts = save_and_disable_interrupts();
-    for (uint32_t i = 0; i < SWAP_ITERATIONS; i++) {
-
-        gpio_put(LED_PIN,i & 0x02);
-
-        memcpy(swap_buff_from_downlaod_slot,
-               (void *) (PFB_ADDR_AS_U32(__FLASH_DOWNLOAD_SLOT_START)
-                         + i * FLASH_SECTOR_SIZE),
-               FLASH_SECTOR_SIZE);
-        memcpy(swap_buff_from_application_slot,
-               (void *) (PFB_ADDR_AS_U32(__FLASH_APP_START)
-                         + i * FLASH_SECTOR_SIZE),
-               FLASH_SECTOR_SIZE);
-        flash_range_erase(PFB_ADDR_WITH_XIP_OFFSET_AS_U32(__FLASH_APP_START)
-                                  + i * FLASH_SECTOR_SIZE,
-                          FLASH_SECTOR_SIZE);
-        flash_range_erase(PFB_ADDR_WITH_XIP_OFFSET_AS_U32(
-                                  __FLASH_DOWNLOAD_SLOT_START)
-                                  + i * FLASH_SECTOR_SIZE,
-                          FLASH_SECTOR_SIZE);
-        flash_range_program(PFB_ADDR_WITH_XIP_OFFSET_AS_U32(__FLASH_APP_START)
-                                    + i * FLASH_SECTOR_SIZE,
-                            swap_buff_from_downlaod_slot,
-                            FLASH_SECTOR_SIZE);
-        flash_range_program(PFB_ADDR_WITH_XIP_OFFSET_AS_U32(
-                                    __FLASH_DOWNLOAD_SLOT_START)
-                                    + i * FLASH_SECTOR_SIZE,
-                            swap_buff_from_application_slot,
-                            FLASH_SECTOR_SIZE);
+    for (; offset < swap_size;
+         offset += get_swap_batch_length(offset, swap_size)) {
+        uint32_t len = get_swap_batch_length(offset, swap_size);
+        uint32_t sector = offset / FLASH_SECTOR_SIZE;
+        uint32_t app_batch = _pfb_app_partition_start() - XIP_BASE + offset;
+        uint32_t download_batch =
+                _pfb_download_partition_start() - XIP_BASE + offset;
+        uint32_t stage = resume_stage;
+        resume_stage = SWAP_STAGE_BATCH_DONE;
+
+        gpio_put(LED_PIN, sector & 0x10);
+
+        bool has_download_crcs, has_application_crcs;
+        if (stage == SWAP_STAGE_BATCH_DONE) {
+            has_download_crcs =
+                    read_batch(download_batch, swap_buff_from_downlaod_slot,
+                               len, swap_crcs_from_download_slot);
+            has_application_crcs =
+                    read_batch(app_batch, swap_buff_from_application_slot, len,
+                               swap_crcs_from_application_slot);
+            // Swapping identical batches is a no-op, so don't waste erase
+            // cycles on it. This covers both regular swaps and rollbacks.
+            if (memcmp(swap_buff_from_downlaod_slot,
+                       swap_buff_from_application_slot, len)
+                == 0) {
+                // Recorded as well, so that every entry has a single
+                // possible successor, see is_next_journal_entry().
+                _pfb_swap_journal_record(sector, SWAP_STAGE_BATCH_DONE);
+                skipped_batches++;
+                continue;
+            }
+            if (!write_batch(scratch,
+                             (uint8_t *) swap_buff_from_application_slot,
+                             has_application_crcs
+                                     ? swap_crcs_from_application_slot
+                                     : NULL,
+                             len)) {
+                break;
+            }
+            _pfb_swap_journal_record(sector, SWAP_STAGE_SCRATCH_SAVED);
+            stage = SWAP_STAGE_SCRATCH_SAVED;
+        } else {
+            // Resuming, the original application batch survives only in the
+            // scratch area.
+            has_application_crcs =
+                    read_batch(scratch, swap_buff_from_application_slot, len,
+                               swap_crcs_from_application_slot);
+            has_download_crcs =
+                    read_batch(download_batch, swap_buff_from_downlaod_slot,
+                               len, swap_crcs_from_download_slot);
+        }
+
+        if (stage == SWAP_STAGE_SCRATCH_SAVED) {
+            if (!write_batch(app_batch,
+                             (uint8_t *) swap_buff_from_downlaod_slot,
+                             has_download_crcs ? swap_crcs_from_download_slot
+                                               : NULL,
+                             len)) {
+                break;
+            }
+            _pfb_swap_journal_record(sector, SWAP_STAGE_APP_WRITTEN);
+        }
+        if (!write_batch(download_batch,
+                         (uint8_t *) swap_buff_from_application_slot,
+                         has_application_crcs ? swap_crcs_from_application_slot
+                                              : NULL,
+                         len)) {
+            break;
+        }
+        _pfb_swap_journal_record(sector, SWAP_STAGE_BATCH_DONE);
+        swapped_batches++;
     }
     restore_interrupts(saved_interrupts);
+    if (offset < swap_size) {
+        printf("SWAP FAILED AT SECTOR %ld\n", offset / FLASH_SECTOR_SIZE);
+        return 1;
+    }
+
+    uint64_t hash_start_us = time_us_64();
+    _pfb_crc_table_store(_pfb_app_partition_start(), swap_size,
+                         download_timestamp);
+    _pfb_crc_table_store(_pfb_download_partition_start(), swap_size,
+                         application_timestamp);
+    boot_timings.hash_us += get_elapsed_us(hash_start_us);
+    printf("SWAPPED %ld batches (%ld identical)\n", swapped_batches,
+           skipped_batches);
+    return 0;
 }
+#endif // PFB_WITH_DIRECT_XIP
 
 static void disable_interrupts(void) {
     SysTick->CTRL &= ~1;
@@ -132,6 +555,119 @@ static void jump_to_vtor(uint32_t vtor) {
     asm volatile("bx %0" ::"r"(reset_vector));
 }
 
+#ifdef PFB_WITH_OVERCLOCK
+// Used for flash parts which are not listed in flash_clock_profiles.
+#    define OVERCLOCK_DEFAULT_MAX_SCK_KHZ 50000
+
+/**
+ * The highest SCK frequency the flash part is known to work with in the quad
+ * I/O fast read mode set up by boot2, with some margin.
+ */
+typedef struct {
+    uint32_t jedec_id;
+    uint32_t max_sck_khz;
+} flash_clock_profile_t;
+
+static const flash_clock_profile_t flash_clock_profiles[] = {
+    { 0xef4015, 100000 }, // Winbond W25Q16JV
+    { 0xef4016, 100000 }, // Winbond W25Q32JV
+    { 0xef4017, 100000 }, // Winbond W25Q64JV
+    { 0xef4018, 100000 }, // Winbond W25Q128JV
+};
+
+static uint32_t overclock_restore_khz;
+
+/**
+ * Returns the highest system clock which keeps the flash SCK in spec. The SDK
+ * re-runs boot2 after every erase/program, which restores its own QSPI clock
+ * divider, so the system clock is limited instead of the divider being raised.
+ */
+static uint32_t get_overclock_khz(void) {
+    uint32_t jedec_id = _pfb_read_flash_jedec_id();
+    uint32_t max_sck_khz = OVERCLOCK_DEFAULT_MAX_SCK_KHZ;
+    for (size_t i = 0; i < count_of(flash_clock_profiles); i++) {
+        if (flash_clock_profiles[i].jedec_id == jedec_id) {
+            max_sck_khz = flash_clock_profiles[i].max_sck_khz;
+            break;
+        }
+    }
+
+    uint32_t max_sys_khz = max_sck_khz * ssi_hw->baudr;
+    return PFB_OVERCLOCK_KHZ < max_sys_khz ? PFB_OVERCLOCK_KHZ : max_sys_khz;
+}
+
+static enum vreg_voltage get_overclock_voltage(uint32_t khz) {
+    if (khz <= 133000) {
+        return VREG_VOLTAGE_DEFAULT;
+    }
+    return khz <= 200000 ? VREG_VOLTAGE_1_15 : VREG_VOLTAGE_1_20;
+}
+
+static void restore_uart_baudrate(void) {
+#    if LIB_PICO_STDIO_UART
+    // clk_peri follows clk_sys, so the divider has to be recalculated.
+    uart_set_baudrate(uart_default, PICO_DEFAULT_UART_BAUD_RATE);
+#    endif // LIB_PICO_STDIO_UART
+}
+
+/**
+ * Raises the system clock for the CPU-bound install phases. Peripherals
+ * clocked from clk_peri (e.g. the Ethernet SPI) must not be used until
+ * @ref overclock_end is called.
+ */
+static void overclock_begin(void) {
+    uint32_t current_khz = clock_get_hz(clk_sys) / 1000;
+    uint32_t khz = get_overclock_khz();
+    if (overclock_restore_khz || khz <= current_khz) {
+        return;
+    }
+
+    vreg_set_voltage(get_overclock_voltage(khz));
+    // Let the core voltage settle before the clock goes up.
+    busy_wait_us(1000);
+    if (!set_sys_clock_khz(khz, false)) {
+        vreg_set_voltage(VREG_VOLTAGE_DEFAULT);
+        return;
+    }
+    overclock_restore_khz = current_khz;
+    restore_uart_baudrate();
+    printf("OVERCLOCKED TO %ld kHz\n", khz);
+}
+
+static void overclock_end(void) {
+    if (!overclock_restore_khz) {
+        return;
+    }
+
+    set_sys_clock_khz(overclock_restore_khz, true);
+    vreg_set_voltage(VREG_VOLTAGE_DEFAULT);
+    overclock_restore_khz = 0;
+    restore_uart_baudrate();
+}
+#else  // PFB_WITH_OVERCLOCK
+static inline void overclock_begin(void) {}
+static inline void overclock_end(void) {}
+#endif // PFB_WITH_OVERCLOCK
+
+/**
+ * Leaves the boot timings and status for the application and jumps into it.
+ */
+static void jump_to_application(uint32_t vtor) {
+    overclock_end();
+    boot_timings.boot_to_jump_us = (uint32_t) time_us_64();
+    _pfb_publish_boot_timings(&boot_timings);
+    _pfb_publish_boot_status(boot_reason, is_info_unchanged);
+#ifdef PFB_WITH_BOOT_HISTORY
+    _pfb_boot_history_append(boot_reason, boot_action,
+                             boot_timings.boot_to_jump_us);
+#endif // PFB_WITH_BOOT_HISTORY
+    _pfb_erase_counters_flush();
+
+    disable_interrupts();
+    reset_peripherals();
+    jump_to_vtor(vtor);
+}
+
 static void print_welcome_message(void) {
 #ifdef PFB_WITH_BOOTLOADER_LOGS
     puts("");
@@ -181,6 +717,9 @@ static char page_recover[] =
 
 
 int main(void) {
+    // Intents left by the application in the watchdog scratch registers.
+    boot_reason = _pfb_boot_reason();
+    is_info_unchanged = _pfb_is_info_unchanged();
     sleep_ms(10);
     
     // Setup the I2S pins to be stable
@@ -206,6 +745,11 @@ int main(void) {
 
         recover = !gpio_get(0) || !gpio_get(8);
     }
+    if (_pfb_is_recovery_requested()) {
+        // Requested once, the next reboot leaves the recovery mode.
+        _pfb_clear_recovery_request();
+        recover = true;
+    }
 
     stdio_init_all();
     gpio_init(LED_PIN);
@@ -312,92 +856,241 @@ int main(void) {
                 char *data = strstr((char *)g_ethernet_buf, "\r\n\r\n") + 4;
                 len = len - ((int32_t)data - (int32_t)g_ethernet_buf);
                 printf("POST got %d bytes\n",len);
+                // The page sends the raw image, so its length is known
+                // upfront and the slot can be erased before receiving it.
+                size_t upload_size = 0;
+                char *content_length = strstr((char *)g_ethernet_buf, "Content-Length:");
+                if (content_length == NULL) content_length = strstr((char *)g_ethernet_buf, "content-length:");
+                if (content_length != NULL && content_length < data) upload_size = strtoul(content_length + 15, NULL, 10);
                 printf("Initializing download slot and downloading\n");
-                pfb_initialize_download_slot();
+                static pfb_stream_t upload_stream;
+                uint32_t erase_us = 0;
+                if (pfb_stream_open(&upload_stream, upload_size, &erase_us)) printf("ERROR INITIALIZING DOWNLOAD SLOT\n");
+                printf("Erased %u bytes in %u us\n", (unsigned)upload_size, (unsigned)erase_us);
 
                 int received = len;
-                int upload_done = 0;
-
-                static char upload_buffer[PFB_ALIGN_SIZE];
-                static int  upload_pos=0;
                 
                 while(len>0)
                 {
-                    while (len && (upload_pos<(int)sizeof(upload_buffer))) 
-                    {
-                        upload_buffer[upload_pos++] = *data++;
-                        len--;
-                    }
+                    // Staged and written by pages, whatever the chunk length.
+                    int ret = pfb_stream_write(&upload_stream, (const uint8_t *)data, len);
+                    if (ret) printf("ERROR LOADING FIRMWARE\n");
 
-                    if (upload_pos==sizeof(upload_buffer))
+                    len = getSn_RX_RSR(1);
+                    if (len>0)
                     {
-                        int ret = pfb_write_to_flash_aligned_256_bytes((uint8_t*)upload_buffer, upload_done, upload_pos);
-                        if (ret) printf("ERROR LOADING FIRMWARE\n");
-                        upload_done += upload_pos;
-                        upload_pos = 0;
-                    }
-
-                    if (len==0)
-                    {
-                        len = getSn_RX_RSR(1);
-                        if (len>0)
-                        {
-                            gpio_put(LED_PIN, !gpio_get(LED_PIN));                        
-                            if (len>(int)sizeof(g_ethernet_buf)) len = sizeof(g_ethernet_buf)-1;
-                            len = recv(1, g_ethernet_buf, len);
-                            data = (char *)g_ethernet_buf;
-                            received += len;
-                            printf("Received %d bytes   total %d\n", len, received);
-                        }
+                        gpio_put(LED_PIN, !gpio_get(LED_PIN));                        
+                        if (len>(int)sizeof(g_ethernet_buf)) len = sizeof(g_ethernet_buf)-1;
+                        len = recv(1, g_ethernet_buf, len);
+                        data = (char *)g_ethernet_buf;
+                        received += len;
+                        printf("Received %d bytes   total %d\n", len, received);
                     }
                 }
         
                 // Will end when the socket closes or there is no more data coming
-                printf("Firmware flash complete  DONE %d\n",upload_done);
-                int ret_sha256 = pfb_firmware_sha256_check(upload_done);
-                if (ret_sha256) { printf("FAILED THE SHA TEST\n"); }
-                else
+                size_t upload_done;
+                pfb_stream_close(&upload_stream, &upload_done);
+                printf("Firmware flash complete  DONE %u\n",(unsigned)upload_done);
+                // The upload is complete, so the Ethernet SPI is not needed
+                // until the device either reboots or closes the socket.
+                overclock_begin();
+                uint64_t hash_start_us = time_us_64();
+                bool is_image_valid = pfb_firmware_sha256_check(upload_done) == 0;
+                boot_timings.hash_us += get_elapsed_us(hash_start_us);
+                if (!is_image_valid) printf("FAILED THE SHA TEST\n");
+#ifdef PFB_WITH_DIRECT_XIP
+                else if (!image_is_linked_for_download_slot()) { printf("IMAGE IS NOT LINKED FOR THE DOWNLOAD SLOT\n"); is_image_valid = false; }
+                // Activating the slot is just a few flash info writes, so the
+                // clocks are restored whatever the result.
+                overclock_end();
+#else  // PFB_WITH_DIRECT_XIP
+                // Only the copy below is worth keeping the clocks up for.
+                if (!is_image_valid) overclock_end();
+#endif // PFB_WITH_DIRECT_XIP
+                if (is_image_valid)
                 {
+#ifdef PFB_WITH_DIRECT_XIP
+                    printf("SHA PASSED AND NOW ACTIVATING THIS FIRMWARE!!!!\n");
+                    boot_action = PFB_BOOT_ACTION_RECOVERY;
+                    pfb_info_begin();
+                    pfb_mark_download_slot_as_invalid();            // Load slot is invalid
+                    _pfb_activate_download_slot();                  // Nothing to roll back to
+                    pfb_firmware_commit();                          // Commit this - no rollback
+                    _pfb_mark_pico_has_no_new_firmware();           // This is not considered new firmware
+                    _pfb_mark_is_not_after_rollback();              // This is not after a rollback
+                    pfb_info_commit();
+                    jump_to_application(_pfb_active_slot_start());  // Start up the application
+#else // PFB_WITH_DIRECT_XIP
                     printf("SHA PASSED AND NOW SWAPPING IN THIS FIRMWARE!!!!\n");
-                    pfb_mark_download_slot_as_valid(upload_done);   // Swap it in             
-                    swap_images();
+                    pfb_mark_download_slot_as_valid_with_mode(upload_done, PFB_INSTALL_MODE_COPY);
+                    if (copy_image())                               // Nothing to roll back to
+                    {
+                        // The copy is retried on the next boot, see above.
+                        printf("FAILED TO INSTALL THE FIRMWARE\n");
+                        overclock_end();
+                        close(1);
+                        continue;
+                    }
+                    boot_action = PFB_BOOT_ACTION_RECOVERY;
+                    pfb_info_begin();
                     pfb_firmware_commit();                          // Commit this - no rollback
                     _pfb_mark_pico_has_no_new_firmware();           // This is not considered new firmware
                     _pfb_mark_is_not_after_rollback();              // This is not after a rollback
                     pfb_mark_download_slot_as_invalid();            // Load slot is invalid
-                    disable_interrupts();
-                    reset_peripherals();
-                    jump_to_vtor(__flash_info_app_vtor);            // Start up the application
+                    pfb_info_commit();
+                    jump_to_application(_pfb_app_partition_start()); // Start up the application
+#endif // PFB_WITH_DIRECT_XIP
                 }
             }
             close(1);
         }
     }
 
-    if (_pfb_should_rollback()) {
+    if (is_info_unchanged) {
+        // Nothing has been downloaded or committed since the last boot, which
+        // left nothing to do, so the flash info doesn't have to be read.
+        BOOTLOADER_LOG("Nothing changed, executing the application...\n");
+#ifdef PFB_WITH_DIRECT_XIP
+        jump_to_application(_pfb_active_slot_start());
+#else  // PFB_WITH_DIRECT_XIP
+        jump_to_application(_pfb_app_partition_start());
+#endif // PFB_WITH_DIRECT_XIP
+    }
+
+    uint64_t metadata_start_us = time_us_64();
+    // An image which is not committed gets PFB_BOOT_ATTEMPTS boots, so that
+    // e.g. a brown-out during its first boot doesn't roll it back.
+    uint32_t boot_attempts = _pfb_boot_attempts();
+    bool should_retry = _pfb_should_rollback()
+                        && boot_attempts < PFB_BOOT_ATTEMPTS;
+    bool should_rollback = _pfb_should_rollback() && !should_retry;
+    bool has_firmware_to_swap = _pfb_has_firmware_to_swap();
+    bool should_install_by_copy = _pfb_should_install_by_copy();
+    boot_timings.metadata_us = get_elapsed_us(metadata_start_us);
+
+    if ((should_rollback || has_firmware_to_swap) && !_pfb_is_layout_in_flash()) {
+        // Built for a bigger flash part than the one detected, the slots would
+        // wrap around onto the bootloader and the application. The flags are
+        // left as they are and the current application is started.
+        printf("THE FLASH IS SMALLER THAN THE LAYOUT, NOT INSTALLING\n");
+#ifdef PFB_WITH_DIRECT_XIP
+        jump_to_application(_pfb_active_slot_start());
+#else  // PFB_WITH_DIRECT_XIP
+        jump_to_application(_pfb_app_partition_start());
+#endif // PFB_WITH_DIRECT_XIP
+    }
+
+    // Activating a direct-XIP slot is just a few flash info writes, not worth
+    // changing the clocks for.
+#ifndef PFB_WITH_DIRECT_XIP
+    if (should_rollback || has_firmware_to_swap) {
+        overclock_begin();
+    }
+#endif // PFB_WITH_DIRECT_XIP
+
+    // All the flag updates below land in the flash info sector together, once
+    // the image is installed. A power loss before that leaves the flags as
+    // they were, so the install is simply repeated or resumed.
+    uint64_t install_start_us = time_us_64();
+    bool is_install_failed = false;
+    pfb_info_begin();
+#ifdef PFB_WITH_DIRECT_XIP
+    (void) should_install_by_copy;
+    if (should_retry) {
+        BOOTLOADER_LOG("Retrying the uncommitted firmware");
+        boot_action = PFB_BOOT_ACTION_RETRY;
+        _pfb_mark_boot_attempts(boot_attempts + 1);
+        install_start_us = time_us_64();
+    } else if (should_rollback) {
         BOOTLOADER_LOG("Rolling back to the previous firmware");
-        swap_images();
+        boot_action = PFB_BOOT_ACTION_ROLLBACK;
+        _pfb_invalidate_active_slot();
         pfb_firmware_commit();
         _pfb_mark_pico_has_no_new_firmware();
         _pfb_mark_is_after_rollback();
-    } else if (_pfb_has_firmware_to_swap()) {
-        BOOTLOADER_LOG("Swapping images");
-        swap_images();
+    } else if (has_firmware_to_swap && image_is_linked_for_download_slot()) {
+        BOOTLOADER_LOG("Activating the download slot");
+        boot_action = PFB_BOOT_ACTION_ACTIVATE;
+        boot_timings.install_size = _pfb_firmware_swap_size();
+        // Nothing is copied, the download slot simply becomes the active one.
+        _pfb_activate_download_slot();
+        _pfb_mark_should_rollback();
+        _pfb_mark_boot_attempts(1);
         _pfb_mark_pico_has_new_firmware();
         _pfb_mark_is_not_after_rollback();
-        _pfb_mark_should_rollback();
+    } else {
+        BOOTLOADER_LOG("Nothing to activate");
+        // Usually doesn't touch the flash, see the swap variant below.
+        pfb_firmware_commit();
+        _pfb_mark_pico_has_no_new_firmware();
+        install_start_us = time_us_64();
+    }
+#else // PFB_WITH_DIRECT_XIP
+    if (should_retry) {
+        BOOTLOADER_LOG("Retrying the uncommitted firmware");
+        boot_action = PFB_BOOT_ACTION_RETRY;
+        _pfb_mark_boot_attempts(boot_attempts + 1);
+        install_start_us = time_us_64();
+    } else if (should_rollback) {
+        BOOTLOADER_LOG("Rolling back to the previous firmware");
+        boot_action = PFB_BOOT_ACTION_ROLLBACK;
+        is_install_failed = swap_images() != 0;
+        if (!is_install_failed) {
+            pfb_firmware_commit();
+            _pfb_mark_pico_has_no_new_firmware();
+            _pfb_mark_is_after_rollback();
+        }
+    } else if (has_firmware_to_swap && should_install_by_copy) {
+        BOOTLOADER_LOG("Copying image");
+        boot_action = PFB_BOOT_ACTION_COPY;
+        is_install_failed = copy_image() != 0;
+        if (!is_install_failed) {
+            pfb_firmware_commit();
+            _pfb_mark_pico_has_new_firmware();
+            _pfb_mark_is_not_after_rollback();
+        }
+    } else if (has_firmware_to_swap) {
+        BOOTLOADER_LOG("Swapping images");
+        boot_action = PFB_BOOT_ACTION_SWAP;
+        is_install_failed = swap_images() != 0;
+        if (!is_install_failed) {
+            // Committing the flags retires the swap journal.
+            _pfb_mark_should_rollback();
+            _pfb_mark_boot_attempts(1);
+            _pfb_mark_pico_has_new_firmware();
+            _pfb_mark_is_not_after_rollback();
+        }
     } else {
         BOOTLOADER_LOG("Nothing to swap");
+        // Target state of a regular boot. Fields are only written if they
+        // differ, so usually the commit below doesn't touch the flash.
         pfb_firmware_commit();
         _pfb_mark_pico_has_no_new_firmware();
+        install_start_us = time_us_64();
+    }
+#endif // PFB_WITH_DIRECT_XIP
+    if (is_install_failed) {
+        // Nothing has been changed in the transaction, so the commit leaves
+        // the flags and the swap journal as they were and the install is
+        // retried on the next boot. Until then, the half-written slot is never
+        // booted, the recovery mode is entered instead.
+        pfb_info_commit();
+        printf("INSTALL FAILED, ENTERING THE RECOVERY MODE\n");
+        overclock_end();
+        pfb_perform_recovery();
     }
-
     pfb_mark_download_slot_as_invalid();
+    pfb_info_commit();
+    boot_timings.install_us = get_elapsed_us(install_start_us);
+
     BOOTLOADER_LOG("End of execution, executing the application...\n");
 
-    disable_interrupts();
-    reset_peripherals();
-    jump_to_vtor(__flash_info_app_vtor);
+#ifdef PFB_WITH_DIRECT_XIP
+    jump_to_application(_pfb_active_slot_start());
+#else  // PFB_WITH_DIRECT_XIP
+    jump_to_application(_pfb_app_partition_start());
+#endif // PFB_WITH_DIRECT_XIP
 
     return 0;
 }
@@ -30,14 +30,240 @@ extern "C" {
 #include <pico/stdlib.h>
 
 #define PFB_ALIGN_SIZE (256)
+#ifndef PFB_WRITE_BATCH_SECTORS
+#    define PFB_WRITE_BATCH_SECTORS (1)
+#endif // PFB_WRITE_BATCH_SECTORS
+// Bytes erased and programmed by the download writer with interrupts disabled
+// at once, see the PFB_WRITE_BATCH_SECTORS CMake option.
+#define PFB_WRITE_BATCH_SIZE (PFB_WRITE_BATCH_SECTORS * 4096)
+// Number of 64k blocks of a slot with a separate erase counter, i.e. of half of
+// the flash given by the PFB_FLASH_SIZE CMake option.
+#ifndef PFB_SLOT_BLOCK_COUNT
+#    define PFB_SLOT_BLOCK_COUNT (16)
+#endif // PFB_SLOT_BLOCK_COUNT
+
+/**
+ * Describes how the bootloader installs the image from the download slot.
+ */
+typedef enum {
+    /**
+     * Slots are swapped, so the previous image can be rolled back if the new
+     * one is not committed.
+     */
+    PFB_INSTALL_MODE_SWAP,
+    /**
+     * Download slot is copied into the application slot. Takes half of the
+     * erase/program work of a swap, but the new image can't be rolled back.
+     */
+    PFB_INSTALL_MODE_COPY
+} pfb_install_mode_t;
+
+/**
+ * Describes how an image has been downloaded.
+ */
+typedef enum {
+    /** Image has been downloaded as plain binary. */
+    PFB_IMAGE_ENCRYPTION_NONE,
+    /** Image has been downloaded encrypted with AES ECB. */
+    PFB_IMAGE_ENCRYPTION_AES_ECB
+} pfb_image_encryption_t;
+
+/**
+ * Describes the image held by a slot. It's taken from the image trailer, i.e.
+ * the 256-byte block appended to the image by scripts/sha256_append.py, when
+ * the slot CRC32 table is stored.
+ */
+typedef struct {
+    /** PFB_IMAGE_VERSION property of the application target, 0 if unset. */
+    uint32_t version;
+    /** Git commit hash of the application sources, zeros if unknown. */
+    uint8_t build_id[20];
+    /** Size of the FOTA image in bytes, including the trailer. */
+    uint32_t size;
+    /** SHA256 of the image, as appended to the trailer. */
+    uint8_t digest[32];
+    /** How the image has been downloaded. */
+    pfb_image_encryption_t encryption;
+    /**
+     * Time the image has been marked as valid, in seconds since the Unix
+     * epoch, read from the RTC. 0 if the RTC was not running.
+     */
+    uint32_t install_timestamp;
+} pfb_image_descriptor_t;
+
+/**
+ * Reason of the last boot, as seen by the bootloader.
+ */
+typedef enum {
+    /** Power-on, or a boot the bootloader couldn't tell anything about. */
+    PFB_BOOT_REASON_POWER_ON,
+    /** Reset which was not caused by the watchdog, e.g. by the RUN pin. */
+    PFB_BOOT_REASON_RESET,
+    /** Watchdog reset the application hasn't asked for anything with. */
+    PFB_BOOT_REASON_WATCHDOG,
+    /** Reboot after an image has been marked as valid. */
+    PFB_BOOT_REASON_UPDATE,
+    /** Reboot requested with @ref pfb_perform_recovery. */
+    PFB_BOOT_REASON_RECOVERY
+} pfb_boot_reason_t;
+
+/**
+ * What the bootloader has done during a boot.
+ */
+typedef enum {
+    /** Nothing, the application has been started as it was. */
+    PFB_BOOT_ACTION_NONE,
+    /** The image from the download slot has been swapped in. */
+    PFB_BOOT_ACTION_SWAP,
+    /** The image from the download slot has been copied in. */
+    PFB_BOOT_ACTION_COPY,
+    /** The direct-XIP download slot has been activated. */
+    PFB_BOOT_ACTION_ACTIVATE,
+    /** The uncommitted image has been given another boot attempt. */
+    PFB_BOOT_ACTION_RETRY,
+    /** The uncommitted image has been rolled back. */
+    PFB_BOOT_ACTION_ROLLBACK,
+    /** An image has been installed in the recovery mode. */
+    PFB_BOOT_ACTION_RECOVERY
+} pfb_boot_action_t;
+
+/**
+ * Record of a single boot, see @ref pfb_get_boot_history.
+ */
+typedef struct {
+    /** Number of the boot, increasing by one with every recorded boot. */
+    uint32_t sequence;
+    /** Reason of the boot. */
+    pfb_boot_reason_t reason;
+    /** What the bootloader has done. */
+    pfb_boot_action_t action;
+    /** Time from the reset to the jump into the application. */
+    uint32_t duration_us;
+    /** Version of the started image, 0 if it has no descriptor. */
+    uint32_t image_version;
+} pfb_boot_record_t;
+
+/**
+ * State of a download, see @ref pfb_stream_open. Its fields are internal.
+ *
+ * The stream only stages a page, so it may be kept on the stack. Write batches
+ * are gathered in a static buffer of the library instead, which takes
+ * @ref PFB_WRITE_BATCH_SIZE bytes of RAM, and as much again with
+ * PFB_WITH_IMAGE_ENCRYPTION for the decrypted batch.
+ */
+typedef struct {
+    /** Bytes written into the download slot so far. */
+    size_t offset;
+    /** Bytes staged in @p buffer. */
+    size_t staged;
+    /** First error returned by a write, sticky until the stream is reopened. */
+    int error;
+    /** Page staged until it's complete. */
+    uint8_t buffer[PFB_ALIGN_SIZE];
+} pfb_stream_t;
+
+/**
+ * Regions of the flash described by the partition table.
+ */
+typedef enum {
+    /** The bootloader, with the partition table in its last sector. */
+    PFB_PARTITION_BOOTLOADER,
+    /** The flash info sector. */
+    PFB_PARTITION_INFO,
+    /** The application slot, the application is linked for its start. */
+    PFB_PARTITION_APPLICATION_SLOT,
+    /** The download slot, as long as the application slot. */
+    PFB_PARTITION_DOWNLOAD_SLOT,
+    /** Region left for the application, e.g. for a file system. */
+    PFB_PARTITION_EXTRA
+} pfb_partition_type_t;
+
+/**
+ * Region of the flash, see @ref pfb_get_partition.
+ */
+typedef struct {
+    /** XIP address of the region. */
+    uint32_t start;
+    /** Length of the region in bytes. */
+    uint32_t length;
+} pfb_partition_t;
+
+/**
+ * Number of erases of the flash regions, see @ref pfb_get_erase_counters.
+ * A counter is an upper bound of the erase count of every sector of its region.
+ */
+typedef struct {
+    /** Erases of the flash info sector and its mirror. */
+    uint32_t info_sector;
+    /** Erases of the 64k blocks of the application slot. */
+    uint32_t application_slot[PFB_SLOT_BLOCK_COUNT];
+    /** Erases of the 64k blocks of the download slot. */
+    uint32_t download_slot[PFB_SLOT_BLOCK_COUNT];
+} pfb_erase_counters_t;
+
+/**
+ * Flash wear derived from the erase counters, see @ref pfb_get_wear_stats.
+ */
+typedef struct {
+    /** Erase cycles a sector is rated for, see PFB_FLASH_ERASE_ENDURANCE. */
+    uint32_t endurance;
+    /** Erase count of the most worn region. */
+    uint32_t max_erase_count;
+    /** Erase cycles left to the most worn region. */
+    uint32_t remaining_erases;
+    /** Used part of the endurance of the most worn region, in permille. */
+    uint32_t used_permille;
+} pfb_wear_stats_t;
+
+/**
+ * Durations of the bootloader phases during the last boot, in microseconds,
+ * measured with the 64-bit hardware timer.
+ */
+typedef struct {
+    /** Time spent reading the flash info sector to decide what to do. */
+    uint32_t metadata_us;
+    /**
+     * Time spent installing the image, i.e. swapping, copying or rolling back
+     * the slots including the flash info updates. 0 if nothing was installed.
+     */
+    uint32_t install_us;
+    /** Number of bytes installed. */
+    uint32_t install_size;
+    /** Number of erase/program batches written during the install. */
+    uint32_t batch_count;
+    /** Total time spent erasing, programming and verifying the batches. */
+    uint32_t batch_total_us;
+    /** Time spent on the slowest batch. */
+    uint32_t batch_max_us;
+    /**
+     * Time spent hashing images, i.e. checking SHA256 of the images uploaded
+     * in the recovery mode and updating the slot CRC32 tables.
+     */
+    uint32_t hash_us;
+    /** Time from the reset to the jump into the application. */
+    uint32_t boot_to_jump_us;
+} pfb_boot_timings_t;
 
 /**
  * Marks the download slot as valid, i.e. download slot contains proper binary
  * content and the partitions can be swapped. MUST be called before the next
  * reboot, otherwise data from the download slot will be lost.
+ * The image is installed using @ref PFB_INSTALL_MODE_COPY if
+ * @ref PFB_WITH_COPY_ONLY_INSTALL is defined, @ref PFB_INSTALL_MODE_SWAP
+ * otherwise.
  */
 void pfb_mark_download_slot_as_valid(uint32_t size);
 
+/**
+ * Same as @ref pfb_mark_download_slot_as_valid, but records the @p mode that
+ * should be used by the bootloader to install the image.
+ *
+ * @param size Size of the downloaded firmware image in bytes.
+ * @param mode Install mode to be used during the next reboot.
+ */
+void pfb_mark_download_slot_as_valid_with_mode(uint32_t size,
+                                               pfb_install_mode_t mode);
+
 /**
  * Marks the download slot as invalid, i.e. download slot no longer contains
  * proper binary content and the partitions MUST NOT be swapped.
@@ -59,6 +285,11 @@ bool pfb_is_after_firmware_update(void);
  * is 256 bytes alligned.
  * If @ref PFB_WITH_IMAGE_ENCRYPTION is defined, the function will decrypt the
  * downloaded data using the PFB_AES_KEY.
+ * Data is programmed in batches of PFB_WRITE_BATCH_SIZE bytes, each with
+ * interrupts disabled once. Sectors not erased by
+ * @ref pfb_initialize_download_slot are erased in the same batch. Every
+ * written page is verified using CRC32
+ * calculated by the DMA sniffer and programmed again if it doesn't match.
  *
  * @param src          Pointer to the source buffer.
  * @param offset_bytes Offset which should be applied to the beginning of the
@@ -67,7 +298,8 @@ bool pfb_is_after_firmware_update(void);
  *                     be a multiple of 256.
  *
  * @return 1 when @p len_bytes or @p offset_bytes are not multiple of 256 or
- *         when ( @p offset_bytes + @p len_bytes ) exceeds download slot size,
+ *         when ( @p offset_bytes + @p len_bytes ) exceeds download slot size
+ *         or when a page still doesn't match after retrying,
  *         negative mbedtls error code in case of an error if
  *         @ref PFB_WITH_IMAGE_ENCRYPTION is defined,
  *         0 otherwise.
@@ -80,17 +312,237 @@ int pfb_write_to_main_flash_aligned_256_bytes(uint8_t *src,
                                          size_t len_bytes);
 
 /**
- * Initializes the download slot, i.e. erases the download partition. MUST be
- * called before writing data into the flash. Before an erase, the function will
- * call @ref pfb_firmware_commit even if @ref pfb_firmware_commit has been
- * called before.
+ * Initializes the download slot, i.e. erases the part of the download partition
+ * the image will be written into. MUST be called before writing data into the
+ * flash. Before an erase, the function will call @ref pfb_firmware_commit even
+ * if @ref pfb_firmware_commit has been called before.
+ *
+ * The range is erased using 64 KiB block erases wherever it's block-aligned
+ * and 4 KiB sector erases elsewhere, so that writes into it only program the
+ * flash. Sectors written beyond the range, e.g. if the image turns out to be
+ * longer, are erased as the writes reach them.
  *
- * @return mbedtls error code in case of a mbedtls error if
+ * @param image_size    Expected size of the image in bytes, or 0 if it's not
+ *                      known, in which case nothing is erased upfront.
+ * @param out_erase_us  Set to the time the erase took in microseconds. May be
+ *                      NULL.
+ *
+ * @return 1 when @p image_size exceeds download slot size or when the download
+ *         slot lies past the end of the flash part, see
+ *         @ref pfb_get_flash_size,
+ *         mbedtls error code in case of a mbedtls error if
  *         @ref PFB_WITH_IMAGE_ENCRYPTION is defined,
  *         0 otherwise.
  */
-int pfb_initialize_download_slot();
+int pfb_initialize_download_slot(size_t image_size, uint32_t *out_erase_us);
+
+/**
+ * Opens a download into the download slot. It calls
+ * @ref pfb_initialize_download_slot, so it MUST NOT be called in the middle of
+ * another download.
+ *
+ * Only one stream can be open at a time, as every stream gathers its write
+ * batches in the same static buffer of the library. Opening a stream discards
+ * whatever an earlier one hasn't written yet.
+ *
+ * @param stream        Stream to open.
+ * @param image_size    Expected size of the image in bytes, or 0 if it's not
+ *                      known, see @ref pfb_initialize_download_slot.
+ * @param out_erase_us  Set to the time the erase took in microseconds. May be
+ *                      NULL.
+ *
+ * @return The return value of @ref pfb_initialize_download_slot.
+ */
+int pfb_stream_open(pfb_stream_t *stream,
+                    size_t image_size,
+                    uint32_t *out_erase_us);
+
+/**
+ * Writes the next chunk of the image, of any length, e.g. straight from
+ * a network receive buffer. Whole write batches of a word-aligned chunk are
+ * written without copying them, only the rest is copied until its batch is
+ * complete.
+ *
+ * @param stream Stream opened with @ref pfb_stream_open.
+ * @param data   Chunk of the image.
+ * @param len    Length of the chunk in bytes.
+ *
+ * @return The error of @ref pfb_write_to_flash_aligned_256_bytes, returned by
+ *         every later call as well, 0 on success.
+ */
+int pfb_stream_write(pfb_stream_t *stream, const uint8_t *data, size_t len);
+
+/**
+ * Writes the staged tail of the image, padded with 0xff to a full page, and
+ * closes the stream.
+ *
+ * @param stream         Stream opened with @ref pfb_stream_open.
+ * @param out_image_size Number of bytes written to the stream, without the
+ *                       padding. It can be passed straight to
+ *                       @ref pfb_firmware_sha256_check and
+ *                       @ref pfb_mark_download_slot_as_valid.
+ *
+ * @return The first error of the stream, 0 on success.
+ */
+int pfb_stream_close(pfb_stream_t *stream, size_t *out_image_size);
+
+/**
+ * Erases the next part of the download slot in the background, so that the
+ * next download doesn't have to erase anything. Meant to be called in idle
+ * time after @ref pfb_firmware_commit, until it returns 0. Every call issues
+ * at most one erase command, i.e. a 64 KiB block erase or a 4 KiB sector
+ * erase, so interrupts are never disabled for longer than a single erase.
+ *
+ * Once the whole slot is erased, it's recorded in the flash info sector, and
+ * @ref pfb_initialize_download_slot skips the erase. Writing into the slot
+ * clears the record.
+ *
+ * It's safe to call from the same idle loop as a download: from
+ * @ref pfb_initialize_download_slot, or @ref pfb_stream_open, until
+ * @ref pfb_mark_download_slot_as_valid or
+ * @ref pfb_mark_download_slot_as_invalid the slot is left alone.
+ *
+ * @return 1 while there's more to erase,
+ *         0 when the download slot is blank,
+ *         -1 while a download is in progress, when the slot holds an image
+ *         waiting to be installed or an image a rollback would restore, i.e.
+ *         before @ref pfb_firmware_commit, or when it lies past the end of
+ *         the flash part.
+ */
+int pfb_scrub_download_slot(void);
+
+
+/**
+ * Returns the information which image variant should be written into the
+ * download slot. With @ref PFB_WITH_DIRECT_XIP images are executed in place,
+ * so the image has to be linked for the slot it's downloaded into, i.e.
+ * <app_name>_download_slot_fota_image.bin file is required when the
+ * application runs from the application slot, and <app_name>_fota_image.bin
+ * otherwise.
+ *
+ * @return true if <app_name>_download_slot_fota_image.bin should be
+ *         downloaded, false if <app_name>_fota_image.bin should be. Always
+ *         false if @ref PFB_WITH_DIRECT_XIP is not defined.
+ */
+bool pfb_needs_download_slot_image(void);
+
+/**
+ * Verifies the application slot against the per-sector CRC32 table stored when
+ * the image was installed. CRC32 is calculated by the DMA sniffer while the
+ * slot is streamed from flash, so the audit is much faster than a SHA256 check.
+ *
+ * @return 0 on success, 1 if any sector doesn't match or the slot has no CRC32
+ *         table.
+ */
+int pfb_application_slot_crc_audit(void);
+
+/**
+ * Verifies the download slot the same way as
+ * @ref pfb_application_slot_crc_audit. The table of the download slot is
+ * stored by @ref pfb_mark_download_slot_as_valid.
+ *
+ * @return 0 on success, 1 if any sector doesn't match or the slot has no CRC32
+ *         table.
+ */
+int pfb_download_slot_crc_audit(void);
+
+/**
+ * Reads the descriptor of the image the application is executed from. Only
+ * a few words are read from flash, nothing is hashed.
+ *
+ * @param out_descriptor Descriptor of the image.
+ *
+ * @return 0 on success, 1 if the slot has no descriptor, e.g. the image has
+ *         been flashed using the UF2 file or built without
+ *         @ref PFB_WITH_SHA256_HASHING.
+ */
+int pfb_get_application_slot_descriptor(pfb_image_descriptor_t *out_descriptor);
+
+/**
+ * Reads the descriptor of the image in the download slot, the same way as
+ * @ref pfb_get_application_slot_descriptor. It's written by
+ * @ref pfb_mark_download_slot_as_valid.
+ *
+ * @param out_descriptor Descriptor of the image.
+ *
+ * @return 0 on success, 1 if the slot has no descriptor.
+ */
+int pfb_get_download_slot_descriptor(pfb_image_descriptor_t *out_descriptor);
+
+/**
+ * Reads the timings of the last boot, left by the bootloader at the end of RAM.
+ *
+ * @param out_timings Timings of the bootloader phases.
+ *
+ * @return 0 on success, 1 if the bootloader didn't leave valid timings.
+ */
+int pfb_get_boot_timings(pfb_boot_timings_t *out_timings);
+
+/**
+ * Reads the boot history, newest boots first. It's recorded by the bootloader
+ * built with the PFB_WITH_BOOT_HISTORY CMake option, and holds at least the
+ * last 256 boots.
+ *
+ * @param out_records Records of the boots.
+ * @param max_count   Number of records @p out_records can hold.
+ *
+ * @return Number of records read.
+ */
+size_t pfb_get_boot_history(pfb_boot_record_t *out_records, size_t max_count);
+
+/**
+ * Looks a region of the flash up in the partition table. Without a valid
+ * partition table, the layout from linker_definitions.ld is used, with the
+ * flash past the download slot left as the @ref PFB_PARTITION_EXTRA region.
+ *
+ * @param type          Type of the region.
+ * @param out_partition Region of the flash.
+ *
+ * @return 0 on success, 1 if the layout has no such region.
+ */
+int pfb_get_partition(pfb_partition_type_t type,
+                      pfb_partition_t *out_partition);
 
+/**
+ * Returns the size of the flash part, detected from its JEDEC ID, or the
+ * PFB_FLASH_SIZE the layout has been built for if the part doesn't report it.
+ *
+ * @return Size of the flash in bytes.
+ */
+uint32_t pfb_get_flash_size(void);
+
+/**
+ * Reads the erase counters of the flash info sector and of every 64k block of
+ * both slots, including the erases not yet saved in flash.
+ *
+ * @param out_counters Erase counters.
+ */
+void pfb_get_erase_counters(pfb_erase_counters_t *out_counters);
+
+/**
+ * Estimates the flash wear from the erase counters. The most worn region
+ * decides, e.g. the block of the download slot holding the swap scratch area.
+ *
+ * @param out_stats Wear statistics.
+ */
+void pfb_get_wear_stats(pfb_wear_stats_t *out_stats);
+
+/**
+ * Opens a flash info transaction. Until the matching @ref pfb_info_commit, the
+ * flags changed by the other functions of this library (e.g.
+ * @ref pfb_firmware_commit or @ref pfb_mark_download_slot_as_invalid) are only
+ * staged in RAM, and the functions reading them return the staged values.
+ * Transactions can be nested, only the outermost commit writes the flash.
+ */
+void pfb_info_begin(void);
+
+/**
+ * Closes the transaction opened by @ref pfb_info_begin. The changed flags are
+ * written into the flash info sector all at once, so after a power loss
+ * either all or none of them are updated. Nothing is written if no flag has
+ * changed.
+ */
+void pfb_info_commit(void);
 
 /**
  * Performs the firmware update. Reboots the Pico and checks if the partitions
@@ -98,6 +550,28 @@ int pfb_initialize_download_slot();
  */
 void pfb_perform_update(void);
 
+/**
+ * Reboots the Pico into the recovery mode of the bootloader, as if the
+ * recovery buttons were pressed.
+ */
+void pfb_perform_recovery(void);
+
+/**
+ * Returns the reason of the last boot. The bootloader passes it in the
+ * watchdog scratch registers, which are cleared by a power-on.
+ *
+ * @return Reason of the last boot.
+ */
+pfb_boot_reason_t pfb_get_boot_reason(void);
+
+/**
+ * Returns the number of times the bootloader has started the application
+ * since the power-on, including the current one.
+ *
+ * @return Number of application starts, 0 if unknown.
+ */
+uint32_t pfb_get_boot_count(void);
+
 /**
  * Marks the information that the device SHOULD NOT perform rollback in case of
  * a reboot.
@@ -119,6 +593,11 @@ bool pfb_is_after_rollback(void);
  * If @ref WITH_SHA256 is defined, checks if the calculated SHA256 of the image
  * matches the expected one. Otherwise, the function will only return 0.
  *
+ * The SHA256 of an image written from the start of the download slot, in
+ * order, is calculated while it's written, so only the digest is read from
+ * flash. Otherwise, or with the PFB_WITH_SHA256_REVERIFY CMake option, the
+ * whole image is read back and hashed.
+ *
  * @param firmware_size Size of the downloaded firmware image in bytes.
  *
  * @return A negative mbedtls error code on calculation error,
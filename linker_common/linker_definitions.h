@@ -34,8 +34,13 @@ extern "C" {
     (PFB_ADDR_AS_U32(Data) - (XIP_BASE))
 
 extern uint32_t __flash_info_app_vtor;
+extern uint32_t __flash_info_download_slot_vtor;
 extern uint32_t __FLASH_START;
+extern uint32_t __FLASH_SIZE;
+extern uint32_t __BOOTLOADER_LENGTH;
+extern uint32_t __FLASH_PARTITION_TABLE_START;
 extern uint32_t __FLASH_INFO_START;
+extern uint32_t __FLASH_INFO_LENGTH;
 extern uint32_t __FLASH_INFO_APP_HEADER;
 extern uint32_t __FLASH_INFO_DOWNLOAD_HEADER;
 extern uint32_t __FLASH_INFO_IS_DOWNLOAD_SLOT_VALID;
@@ -43,9 +48,31 @@ extern uint32_t __FLASH_INFO_IS_FIRMWARE_SWAPPED;
 extern uint32_t __FLASH_INFO_IS_AFTER_ROLLBACK;
 extern uint32_t __FLASH_INFO_SHOULD_ROLLBACK;
 extern uint32_t __FLASH_INFO_SWAP_SIZE;
+extern uint32_t __FLASH_INFO_INSTALL_MODE;
+extern uint32_t __FLASH_INFO_SLOT_A_SEQUENCE;
+extern uint32_t __FLASH_INFO_SLOT_B_SEQUENCE;
+extern uint32_t __FLASH_INFO_BOOT_ATTEMPTS;
+extern uint32_t __FLASH_INFO_DOWNLOAD_SLOT_BLANK;
+extern uint32_t __FLASH_INFO_HEADER;
+extern uint32_t __FLASH_INFO_LOG;
+extern uint32_t __FLASH_INFO_LOG_LENGTH;
+extern uint32_t __FLASH_INFO_SWAP_JOURNAL;
+extern uint32_t __FLASH_INFO_SWAP_JOURNAL_LENGTH;
 extern uint32_t __FLASH_APP_START;
 extern uint32_t __FLASH_DOWNLOAD_SLOT_START;
 extern uint32_t __FLASH_SWAP_SPACE_LENGTH;
+extern uint32_t __FLASH_SWAP_MAX_LENGTH;
+extern uint32_t __FLASH_SWAP_SCRATCH_START;
+extern uint32_t __FLASH_SWAP_SCRATCH_LENGTH;
+extern uint32_t __FLASH_CRC_TABLES_START;
+extern uint32_t __FLASH_CRC_TABLES_LENGTH;
+extern uint32_t __FLASH_INFO_MIRROR_START;
+extern uint32_t __FLASH_BOOT_HISTORY_START;
+extern uint32_t __FLASH_BOOT_HISTORY_LENGTH;
+extern uint32_t __FLASH_ERASE_COUNTERS_START;
+extern uint32_t __FLASH_ERASE_COUNTERS_LENGTH;
+extern uint32_t __RAM_HANDOFF_START;
+extern uint32_t __RAM_HANDOFF_LENGTH;
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,142 @@
+#!/usr/bin/env python3
+# Copyright (c) 2024 Jakub Zimnol
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+
+from argparse import ArgumentParser
+import os
+import re
+import struct
+import zlib
+
+# Layout of the partition table, see pfb_partition_table_t in pico_fota_bootloader.c
+TABLE_MAGIC = 0x54424650
+TABLE_VERSION = 1
+TABLE_MAX_ENTRIES = 8
+
+PARTITION_TYPES = {'bootloader': 0, 'info': 1, 'application': 2, 'download': 3, 'extra': 4}
+
+SECTOR_SIZE = 4 * 1024
+
+DEFAULT_LINKER_DEFINITIONS = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'linker_common',
+                                          'linker_definitions.ld')
+
+UF2_MAGIC_START0 = 0x0A324655
+UF2_MAGIC_START1 = 0x9E5D5157
+UF2_MAGIC_END = 0x0AB16F30
+UF2_FLAG_FAMILY_ID_PRESENT = 0x00002000
+UF2_RP2040_FAMILY_ID = 0xE48BFF56
+UF2_PAYLOAD_SIZE = 256
+
+
+def _parse_size(value):
+    value = value.strip().lower()
+    if value.endswith('k'):
+        return int(value[:-1], 0) * 1024
+    if value.endswith('m'):
+        return int(value[:-1], 0) * 1024 * 1024
+    return int(value, 0)
+
+
+def read_linker_definitions(path):
+    """
+    Reads the symbols of linker_definitions.ld which are plain sizes or
+    addresses, e.g. `__BOOTLOADER_LENGTH = 124k;`. The bootloader and the info
+    sector are fixed by the bootloader binary, so the table has to match them.
+    """
+    definitions = {}
+    with open(path) as file:
+        for match in re.finditer(r'^(__\w+)\s*=\s*(0x[0-9a-fA-F]+|\d+[kKmM]?)\s*;', file.read(), re.MULTILINE):
+            definitions[match.group(1)] = _parse_size(match.group(2))
+    return definitions
+
+
+def build_table(definitions, slot_length, extra_length):
+    bootloader_length = definitions['__BOOTLOADER_LENGTH']
+    info_length = definitions['__FLASH_INFO_LENGTH']
+    app_offset = bootloader_length + info_length
+    entries = [
+        (PARTITION_TYPES['bootloader'], 0, bootloader_length),
+        (PARTITION_TYPES['info'], bootloader_length, info_length),
+        (PARTITION_TYPES['application'], app_offset, slot_length),
+        (PARTITION_TYPES['download'], app_offset + slot_length, slot_length),
+    ]
+    if extra_length:
+        entries.append((PARTITION_TYPES['extra'], app_offset + 2 * slot_length, extra_length))
+
+    table = struct.pack('<IHH', TABLE_MAGIC, TABLE_VERSION, len(entries))
+    for partition_type, offset, length in entries:
+        table += struct.pack('<IIII', partition_type, offset, length, 0)
+    table += bytes(16 * (TABLE_MAX_ENTRIES - len(entries)))
+    return table + struct.pack('<I', zlib.crc32(table))
+
+
+def to_uf2(data, address):
+    data += b'\xff' * (-len(data) % UF2_PAYLOAD_SIZE)
+    block_count = len(data) // UF2_PAYLOAD_SIZE
+    uf2 = b''
+    for i in range(block_count):
+        payload = data[i * UF2_PAYLOAD_SIZE:(i + 1) * UF2_PAYLOAD_SIZE]
+        uf2 += struct.pack('<IIIIIIII', UF2_MAGIC_START0, UF2_MAGIC_START1, UF2_FLAG_FAMILY_ID_PRESENT,
+                           address + i * UF2_PAYLOAD_SIZE, UF2_PAYLOAD_SIZE, i, block_count,
+                           UF2_RP2040_FAMILY_ID)
+        uf2 += payload + bytes(476 - UF2_PAYLOAD_SIZE) + struct.pack('<I', UF2_MAGIC_END)
+    return uf2
+
+
+def _main():
+    parser = ArgumentParser(
+        description='Generate a partition table, so that the slots can be resized without rebuilding the bootloader.')
+    parser.add_argument('-o', '--output-file', help='Path to the .uf2 or .bin file to write', required=True)
+    parser.add_argument('-s', '--slot-length', help='Length of each slot, e.g. 960k', required=True)
+    parser.add_argument('-e', '--extra-length', help='Length of the region left for the application after the slots',
+                        default='0')
+    parser.add_argument('-f', '--flash-size', help='Size of the flash the bootloader is built for (PFB_FLASH_SIZE), e.g. 2m',
+                        default='2m')
+    parser.add_argument('-l', '--linker-definitions', help='Path to the linker_definitions.ld the bootloader is built with',
+                        default=DEFAULT_LINKER_DEFINITIONS)
+
+    args = parser.parse_args()
+
+    definitions = read_linker_definitions(args.linker_definitions)
+    bootloader_length = definitions['__BOOTLOADER_LENGTH']
+    info_length = definitions['__FLASH_INFO_LENGTH']
+    table_start = definitions['__FLASH_START'] + bootloader_length - definitions['__FLASH_PARTITION_TABLE_LENGTH']
+
+    slot_length = _parse_size(args.slot_length)
+    extra_length = _parse_size(args.extra_length)
+    flash_size = _parse_size(args.flash_size)
+
+    if slot_length % (64 * 1024) or extra_length % SECTOR_SIZE:
+        raise ValueError("Partition table: slots have to be multiples of 64k, the extra region of 4k")
+    if slot_length > flash_size // 2:
+        raise ValueError("Partition table: slots can't be longer than half of the flash")
+    if bootloader_length + info_length + 2 * slot_length + extra_length > flash_size:
+        raise ValueError("Partition table: partitions don't fit in the flash")
+
+    table = build_table(definitions, slot_length, extra_length)
+    with open(args.output_file, 'wb') as file:
+        file.write(to_uf2(table, table_start) if args.output_file.endswith('.uf2') else table)
+
+    print(f"Partition table: written to {args.output_file}")
+
+
+if __name__ == '__main__':
+    _main()
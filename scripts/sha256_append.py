@@ -23,12 +23,33 @@
 from argparse import ArgumentParser
 from hashlib import sha256
 import os
+import struct
+import subprocess
+
+# Layout of the image trailer, see pfb_image_trailer_t in pico_fota_bootloader.c
+TRAILER_MAGIC = 0x49424650
+TRAILER_LENGTH = 256
+SHA256_LENGTH = 32
+BUILD_ID_LENGTH = 20
+
+
+def _get_build_id(source_dir):
+    if not source_dir:
+        return bytes(BUILD_ID_LENGTH)
+    try:
+        commit_hash = subprocess.run(['git', '-C', source_dir, 'rev-parse', 'HEAD'],
+                                     capture_output=True, check=True, text=True).stdout.strip()
+        return bytes.fromhex(commit_hash)[:BUILD_ID_LENGTH]
+    except (OSError, subprocess.CalledProcessError, ValueError):
+        return bytes(BUILD_ID_LENGTH)
 
 
 def _main():
     parser = ArgumentParser(
-        description='Append SHA256 hash to the end of the firmware file thath will be sent to the device.')
+        description='Append the image trailer with SHA256 hash to the end of the firmware file thath will be sent to the device.')
     parser.add_argument('-t', '--target-file', help='Path to the firmware file', required=True)
+    parser.add_argument('-v', '--image-version', help='Version of the image, 32-bit integer', default='')
+    parser.add_argument('-s', '--source-dir', help='Git working tree the build id is taken from', default='')
 
     args = parser.parse_args()
 
@@ -44,11 +65,16 @@ def _main():
     with open(binary_file_path, 'rb') as file:
         binary_file_data = file.read()
 
-    binary_sha256 = sha256(binary_file_data)
+    image_version = int(args.image_version, 0) if args.image_version else 0
+    trailer = struct.pack('<II20sI', TRAILER_MAGIC, image_version, _get_build_id(args.source_dir),
+                          len(binary_file_data))
+    trailer += b'\x00' * (TRAILER_LENGTH - SHA256_LENGTH - len(trailer))
+
+    # The SHA256 covers the trailer too, so the descriptor can't be tampered with
+    binary_sha256 = sha256(binary_file_data + trailer)
 
     with open(binary_file_path, '+ab') as file:
-        padding = b'\x00' * (256 - 32)
-        file.write(padding)
+        file.write(trailer)
         file.write(binary_sha256.digest())
 
 
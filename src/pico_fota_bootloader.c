@@ -21,12 +21,17 @@
  */
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
+#include <hardware/dma.h>
 #include <hardware/flash.h>
+#include <hardware/rtc.h>
+#include <hardware/structs/xip_ctrl.h>
 #include <hardware/sync.h>
 #include <hardware/watchdog.h>
+#include <pico/time.h>
 
 #ifdef PFB_WITH_IMAGE_ENCRYPTION
 #    include <mbedtls/aes.h>
@@ -54,81 +59,1123 @@
 #define PFB_SHOULD_ROLLBACK_MAGIC 0xdeadead
 #define PFB_SHOULD_NOT_ROLLBACK_MAGIC 0x00000000
 
+#define PFB_SLOT_SEQUENCE_INVALID 0x00000000
+#define PFB_SLOT_SEQUENCE_ERASED 0xffffffff
+
+#define PFB_INSTALL_MODE_COPY_MAGIC 0xc0c0c0c0
+#define PFB_INSTALL_MODE_SWAP_MAGIC 0x00000000
+
+#define PFB_DOWNLOAD_SLOT_NOT_BLANK 0x00000000
+
+#ifdef PFB_WITH_COPY_ONLY_INSTALL
+#    define PFB_DEFAULT_INSTALL_MODE PFB_INSTALL_MODE_COPY
+#else // PFB_WITH_COPY_ONLY_INSTALL
+#    define PFB_DEFAULT_INSTALL_MODE PFB_INSTALL_MODE_SWAP
+#endif // PFB_WITH_COPY_ONLY_INSTALL
+
 #define PFB_SHA256_DIGEST_SIZE 32
 #define PFB_AES_BLOCK_SIZE 16
+#define PFB_SHA256_READ_CHUNK_SIZE 1024
+
+#define PFB_CRC32_SEED 0xffffffff
+#define PFB_CRC_TABLE_MAGIC 0x43524354
+#define PFB_CRC_TABLE_HEADER_WORDS 2
+#define PFB_PROGRAM_RETRIES 3
+
+#define PFB_BOOT_TIMINGS_MAGIC 0x54494d45
+
+#define PFB_BOOT_HISTORY_ERASED_SEQUENCE 0xffffffff
+
+#define PFB_FLASH_CMD_READ_JEDEC_ID 0x9f
+// The last byte of the JEDEC ID is log2 of the flash size, 2M to 16M are used.
+#define PFB_FLASH_MIN_CAPACITY_CODE 0x15
+#define PFB_FLASH_MAX_CAPACITY_CODE 0x18
+
+#define PFB_PARTITION_TABLE_MAGIC 0x54424650
+#define PFB_PARTITION_TABLE_VERSION 1
+#define PFB_PARTITION_TABLE_MAX_ENTRIES 8
+#define PFB_PARTITION_TYPE_COUNT (PFB_PARTITION_EXTRA + 1)
+
+#define PFB_IMAGE_TRAILER_MAGIC 0x49424650
+#define PFB_IMAGE_DESCRIPTOR_MAGIC 0x44455343
+
+/**
+ * Watchdog scratch registers survive every reset but the power-on one. The
+ * bootloader leaves the boot status in them, and the application leaves its
+ * intents for the next boot. Registers 4-7 are used by the SDK and bootrom.
+ */
+#define PFB_WATCHDOG_MAGIC 0x50464257
+#define PFB_WATCHDOG_SCRATCH_MAGIC 0
+#define PFB_WATCHDOG_SCRATCH_FLAGS 1
+#define PFB_WATCHDOG_SCRATCH_BOOT_COUNT 2
+#define PFB_WATCHDOG_SCRATCH_BOOT_REASON 3
+// An image has been marked as valid since the last boot.
+#define PFB_WATCHDOG_FLAG_INSTALL (1u << 0)
+// The recovery mode has been requested.
+#define PFB_WATCHDOG_FLAG_RECOVERY (1u << 1)
+// The running image has to be committed, or it will be rolled back.
+#define PFB_WATCHDOG_FLAG_ROLLBACK_ARMED (1u << 2)
+// The running image is marked as new, which the next boot clears.
+#define PFB_WATCHDOG_FLAG_NEW_FIRMWARE (1u << 3)
+
+#define PFB_SWAP_JOURNAL_EMPTY_ENTRY 0xffff
+#define PFB_SWAP_JOURNAL_STAGE_BITS 4
+#define PFB_SWAP_JOURNAL_STAGE_MASK ((1 << PFB_SWAP_JOURNAL_STAGE_BITS) - 1)
+// Opens a swap, holds the length of the info log instead of a sector number.
+#define PFB_SWAP_JOURNAL_STAGE_BEGIN 0
+
+#define PFB_INFO_RECORD_ERASED_FIELD 0xffff
+#define PFB_INFO_RECORD_INDEX_MASK 0x003f
+#define PFB_INFO_RECORD_CONTINUES 0x0080
+#define PFB_INFO_RECORD_TAG_SHIFT 8
+#define PFB_INFO_RECORD_TAG_MASK 0xff00
+// Fields from the first 128 bytes of the info sector can be logged.
+#define PFB_INFO_FIELD_COUNT 32
+
+#define PFB_ERASE_SNAPSHOT_ERASED_SEQUENCE 0xffffffff
+#define PFB_ERASE_REGION_INFO 0
+#define PFB_ERASE_REGION_APPLICATION_SLOT 1
+#define PFB_ERASE_REGION_DOWNLOAD_SLOT (1 + PFB_SLOT_BLOCK_COUNT)
+#define PFB_ERASE_REGION_COUNT (1 + 2 * PFB_SLOT_BLOCK_COUNT)
+
+#define PFB_INFO_COPY_MAGIC 0x494e464f
+// Programmed with the bootloader, see bootloader.ld.
+#define PFB_INFO_COPY_FACTORY_MAGIC 0x46414354
+#define PFB_INFO_COPY_RETIRED_MAGIC 0x00000000
+
+#ifdef PFB_WITH_IMAGE_ENCRYPTION
+mbedtls_aes_context g_aes_ctx;
+#endif // PFB_WITH_IMAGE_ENCRYPTION
+
+/**
+ * Layout of the RAM handoff area, see __RAM_HANDOFF_START.
+ */
+typedef struct {
+    uint32_t magic;
+    pfb_boot_timings_t timings;
+    uint32_t checksum;
+} pfb_ram_handoff_t;
+
+/**
+ * Layout of the last 256 bytes of a FOTA image, see scripts/sha256_append.py.
+ * The SHA256 covers the image and the rest of the trailer.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint8_t build_id[20];
+    // Size of the image without the trailer.
+    uint32_t image_size;
+    uint8_t reserved[192];
+    uint8_t sha256[PFB_SHA256_DIGEST_SIZE];
+} pfb_image_trailer_t;
+
+static_assert(sizeof(pfb_image_trailer_t) == PFB_ALIGN_SIZE,
+              "Image trailer has to take exactly one page");
+
+/**
+ * Layout of the image descriptor, kept at the end of the CRC32 table sector of
+ * the slot.
+ */
+typedef struct {
+    uint32_t magic;
+    pfb_image_descriptor_t descriptor;
+    uint32_t checksum;
+} pfb_slot_descriptor_t;
+
+/**
+ * Layout of a boot history entry. Entries are appended to the sectors of the
+ * boot history in order, and entries torn by a power loss fail the check.
+ */
+typedef struct {
+    uint32_t sequence;
+    uint8_t reason;
+    uint8_t action;
+    uint16_t check;
+    uint32_t duration_us;
+    uint32_t image_version;
+} pfb_boot_history_entry_t;
+
+/**
+ * Snapshot of the erase counters, see _pfb_erase_counters_flush(). Snapshots
+ * are rounded up to whole pages and appended to the sectors at
+ * __FLASH_ERASE_COUNTERS_START in order, the newest valid one holds the
+ * counters.
+ */
+typedef struct {
+    uint32_t sequence;
+    uint32_t counts[PFB_ERASE_REGION_COUNT];
+    uint32_t checksum;
+} pfb_erase_snapshot_t;
+
+#define PFB_ERASE_SNAPSHOT_SIZE                                         \
+    ((sizeof(pfb_erase_snapshot_t) + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE \
+     * FLASH_PAGE_SIZE)
+#define PFB_ERASE_SNAPSHOTS_PER_SECTOR \
+    (FLASH_SECTOR_SIZE / PFB_ERASE_SNAPSHOT_SIZE)
+
+static_assert(PFB_ERASE_SNAPSHOT_SIZE <= FLASH_SECTOR_SIZE,
+              "Erase counters snapshot has to fit in a sector");
+
+// Shared with the bootloader, defined at the end of the file.
+void _pfb_crc_table_invalidate(uint32_t slot_start);
+int _pfb_crc_table_store(uint32_t slot_start,
+                         uint32_t size,
+                         uint32_t install_timestamp);
+int _pfb_crc_table_audit(uint32_t slot_start);
+
+/**
+ * The flash info sector is an append-only log. Its first page holds the base
+ * value of every field, at the offsets from linker_definitions.ld. A change of
+ * a field is appended to the info log as a record. Programming a record only
+ * clears bits of erased bytes, so no erase is needed, and the latest valid
+ * record of a field wins. The sector is erased only to compact a full log.
+ *
+ * Changes committed together are appended as a group of records. Every record
+ * of a group is tagged with the log index of the first one, and all of them
+ * but the last one have PFB_INFO_RECORD_CONTINUES set. Readers apply a group
+ * only once they reach its last record, so a group torn by a power loss is
+ * ignored as a whole, even if other groups are appended behind it later.
+ */
+typedef struct {
+    uint16_t field;
+    uint16_t check;
+    uint32_t value;
+} pfb_info_record_t;
+
+/**
+ * There are two copies of the info sector, __FLASH_INFO_START and
+ * __FLASH_INFO_MIRROR_START. Compaction writes the spare copy with the next
+ * sequence number, so the copy in use is never erased. The header at
+ * __FLASH_INFO_HEADER is programmed together with the base page, and its CRC32
+ * covers the base values, so a copy torn by a power loss is never used.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t crc;
+} pfb_info_header_t;
+
+/**
+ * Layout of the partition table at __FLASH_PARTITION_TABLE_START, see
+ * scripts/partition_table.py. Offsets are relative to the start of the flash,
+ * and the CRC32 covers everything before it.
+ */
+typedef struct {
+    uint32_t type;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t flags;
+} pfb_partition_entry_t;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;
+    pfb_partition_entry_t entries[PFB_PARTITION_TABLE_MAX_ENTRIES];
+    uint32_t crc;
+} pfb_partition_table_t;
+
+// Size of the flash part, 0 until it's detected.
+static uint32_t g_flash_size;
+
+/**
+ * Flash layout in use, looked up once, see get_layout().
+ */
+static struct {
+    bool is_loaded;
+    uint32_t present_partitions;
+    pfb_partition_t partitions[PFB_PARTITION_TYPE_COUNT];
+} g_layout;
+
+// XIP address of the info copy in use, 0 until it's looked up.
+static uint32_t g_info_copy_start;
+
+/**
+ * Info fields staged by the open transaction, see pfb_info_begin().
+ */
+static struct {
+    uint32_t depth;
+    uint32_t changed_fields;
+    uint32_t values[PFB_INFO_FIELD_COUNT];
+} g_info_transaction;
+
+static uint32_t update_crc32(uint32_t crc, uint8_t byte) {
+    crc ^= byte;
+    for (int bit = 0; bit < 8; bit++) {
+        crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return crc;
+}
+
+static uint32_t get_info_copy_crc32(uint32_t copy_start, uint32_t sequence) {
+    const uint8_t *base = (const uint8_t *) copy_start;
+    uint32_t crc = PFB_CRC32_SEED;
+
+    for (size_t i = 0; i < PFB_INFO_FIELD_COUNT * sizeof(uint32_t) + 4; i++) {
+        crc = update_crc32(crc,
+                           i < PFB_INFO_FIELD_COUNT * sizeof(uint32_t)
+                                   ? base[i]
+                                   : (uint8_t) (sequence >> (8 * (i % 4))));
+    }
+    return ~crc;
+}
+
+uint32_t _pfb_read_flash_jedec_id(void) {
+    uint8_t txbuf[4] = {PFB_FLASH_CMD_READ_JEDEC_ID};
+    uint8_t rxbuf[4] = {0};
+
+    uint32_t saved_interrupts = save_and_disable_interrupts();
+    flash_do_cmd(txbuf, rxbuf, sizeof(txbuf));
+    restore_interrupts(saved_interrupts);
+
+    return (uint32_t) rxbuf[1] << 16 | (uint32_t) rxbuf[2] << 8 | rxbuf[3];
+}
+
+/**
+ * Returns the size of the flash part, detected from its JEDEC ID. Parts which
+ * don't report a known capacity are assumed to be as big as the PFB_FLASH_SIZE
+ * the layout has been built for.
+ */
+static uint32_t get_flash_size(void) {
+    if (!g_flash_size) {
+        uint8_t capacity_code = (uint8_t) _pfb_read_flash_jedec_id();
+        g_flash_size = capacity_code >= PFB_FLASH_MIN_CAPACITY_CODE
+                                       && capacity_code
+                                                  <= PFB_FLASH_MAX_CAPACITY_CODE
+                               ? 1u << capacity_code
+                               : PFB_ADDR_AS_U32(__FLASH_SIZE);
+    }
+    return g_flash_size;
+}
+
+static void set_partition(pfb_partition_type_t type,
+                          uint32_t start,
+                          uint32_t length) {
+    g_layout.partitions[type].start = start;
+    g_layout.partitions[type].length = length;
+    g_layout.present_partitions |= 1u << type;
+}
+
+/**
+ * Sets the layout given by linker_definitions.ld, used when there's no valid
+ * partition table. Flash past the download slot, e.g. of a part bigger than
+ * the one the layout has been built for, is left as the extra region.
+ */
+static void set_default_layout(void) {
+    g_layout.present_partitions = 0;
+    set_partition(PFB_PARTITION_BOOTLOADER, PFB_ADDR_AS_U32(__FLASH_START),
+                  PFB_ADDR_AS_U32(__BOOTLOADER_LENGTH));
+    set_partition(PFB_PARTITION_INFO, PFB_ADDR_AS_U32(__FLASH_INFO_START),
+                  PFB_ADDR_AS_U32(__FLASH_INFO_LENGTH));
+    set_partition(PFB_PARTITION_APPLICATION_SLOT,
+                  PFB_ADDR_AS_U32(__FLASH_APP_START),
+                  PFB_ADDR_AS_U32(__FLASH_SWAP_SPACE_LENGTH));
+    set_partition(PFB_PARTITION_DOWNLOAD_SLOT,
+                  PFB_ADDR_AS_U32(__FLASH_DOWNLOAD_SLOT_START),
+                  PFB_ADDR_AS_U32(__FLASH_SWAP_SPACE_LENGTH));
+
+    uint32_t extra_start = PFB_ADDR_AS_U32(__FLASH_DOWNLOAD_SLOT_START)
+                           + PFB_ADDR_AS_U32(__FLASH_SWAP_SPACE_LENGTH);
+    uint32_t flash_end = PFB_ADDR_AS_U32(__FLASH_START) + get_flash_size();
+    if (flash_end > extra_start) {
+        set_partition(PFB_PARTITION_EXTRA, extra_start, flash_end - extra_start);
+    }
+}
+
+static bool is_partition_entry_valid(const pfb_partition_entry_t *entry) {
+    return entry->type < PFB_PARTITION_TYPE_COUNT
+           && entry->offset % FLASH_SECTOR_SIZE == 0
+           && entry->length % FLASH_SECTOR_SIZE == 0 && entry->length > 0
+           && entry->offset <= get_flash_size()
+           && entry->length <= get_flash_size() - entry->offset;
+}
+
+/**
+ * Checks that the layout loaded from the partition table can be used by this
+ * bootloader. The bootloader and info partitions are fixed by the bootloader
+ * binary, and so is the start of the application slot, as every application
+ * is linked for it. The slots have to fit the swap scratch area and the
+ * structures kept in the tail of the application slot, and be a whole number of
+ * 64k blocks long, so that swap batches are block-aligned in both of them.
+ */
+static bool is_layout_valid(void) {
+    const pfb_partition_t *partitions = g_layout.partitions;
+    const uint32_t required = 1u << PFB_PARTITION_BOOTLOADER
+                              | 1u << PFB_PARTITION_INFO
+                              | 1u << PFB_PARTITION_APPLICATION_SLOT
+                              | 1u << PFB_PARTITION_DOWNLOAD_SLOT;
+    if ((g_layout.present_partitions & required) != required
+        || partitions[PFB_PARTITION_BOOTLOADER].start
+                   != PFB_ADDR_AS_U32(__FLASH_START)
+        || partitions[PFB_PARTITION_BOOTLOADER].length
+                   != PFB_ADDR_AS_U32(__BOOTLOADER_LENGTH)
+        || partitions[PFB_PARTITION_INFO].start
+                   != PFB_ADDR_AS_U32(__FLASH_INFO_START)
+        || partitions[PFB_PARTITION_INFO].length
+                   != PFB_ADDR_AS_U32(__FLASH_INFO_LENGTH)) {
+        return false;
+    }
+
+    const pfb_partition_t *app = &partitions[PFB_PARTITION_APPLICATION_SLOT];
+    const pfb_partition_t *download = &partitions[PFB_PARTITION_DOWNLOAD_SLOT];
+    uint32_t tail_length = PFB_ADDR_AS_U32(__FLASH_ERASE_COUNTERS_START)
+                           + PFB_ADDR_AS_U32(__FLASH_ERASE_COUNTERS_LENGTH)
+                           - PFB_ADDR_AS_U32(__FLASH_CRC_TABLES_START);
+    if (app->start != PFB_ADDR_AS_U32(__FLASH_APP_START)
+        || app->length != download->length
+        || app->length > PFB_SLOT_BLOCK_COUNT * FLASH_BLOCK_SIZE
+        || app->length % FLASH_BLOCK_SIZE != 0
+        || app->length
+                   < PFB_ADDR_AS_U32(__FLASH_SWAP_SCRATCH_LENGTH) + tail_length
+        || (download->start + download->length) % FLASH_BLOCK_SIZE != 0) {
+        return false;
+    }
+
+    for (int i = 0; i < PFB_PARTITION_TYPE_COUNT; i++) {
+        for (int j = i + 1; j < PFB_PARTITION_TYPE_COUNT; j++) {
+            if ((g_layout.present_partitions & (1u << i))
+                && (g_layout.present_partitions & (1u << j))
+                && partitions[i].start < partitions[j].start + partitions[j].length
+                && partitions[j].start < partitions[i].start + partitions[i].length) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Loads the layout from the partition table. Returns false if the table is
+ * missing or malformed.
+ */
+static bool load_partition_table(void) {
+    const pfb_partition_table_t *table =
+            (const pfb_partition_table_t *) PFB_ADDR_AS_U32(
+                    __FLASH_PARTITION_TABLE_START);
+    if (table->magic != PFB_PARTITION_TABLE_MAGIC
+        || table->version != PFB_PARTITION_TABLE_VERSION
+        || table->count > PFB_PARTITION_TABLE_MAX_ENTRIES) {
+        return false;
+    }
+
+    uint32_t crc = PFB_CRC32_SEED;
+    for (size_t i = 0; i < offsetof(pfb_partition_table_t, crc); i++) {
+        crc = update_crc32(crc, ((const uint8_t *) table)[i]);
+    }
+    if (~crc != table->crc) {
+        return false;
+    }
+
+    g_layout.present_partitions = 0;
+    for (uint16_t i = 0; i < table->count; i++) {
+        const pfb_partition_entry_t *entry = &table->entries[i];
+        if (!is_partition_entry_valid(entry)
+            || (g_layout.present_partitions & (1u << entry->type))) {
+            return false;
+        }
+        set_partition((pfb_partition_type_t) entry->type,
+                      PFB_ADDR_AS_U32(__FLASH_START) + entry->offset,
+                      entry->length);
+    }
+    return is_layout_valid();
+}
+
+/**
+ * Returns the flash layout in use. It's taken from the partition table if
+ * there's a valid one, and from linker_definitions.ld otherwise.
+ */
+static const pfb_partition_t *get_layout(void) {
+    if (!g_layout.is_loaded) {
+        if (!load_partition_table()) {
+            set_default_layout();
+        }
+        g_layout.is_loaded = true;
+    }
+    return g_layout.partitions;
+}
+
+static uint32_t get_app_partition_start(void) {
+    return get_layout()[PFB_PARTITION_APPLICATION_SLOT].start;
+}
+
+/**
+ * Returns true if both slots of the layout in use lie within the flash part.
+ * They don't if the bootloader has been built with a PFB_FLASH_SIZE bigger
+ * than the part detected. XIP addresses past the end of the part wrap around
+ * onto the bootloader and the application, so nothing may be installed then.
+ */
+static bool is_layout_in_flash(void) {
+    const pfb_partition_t *layout = get_layout();
+    uint32_t flash_end = PFB_ADDR_AS_U32(__FLASH_START) + get_flash_size();
+    const pfb_partition_t *app = &layout[PFB_PARTITION_APPLICATION_SLOT];
+    const pfb_partition_t *download = &layout[PFB_PARTITION_DOWNLOAD_SLOT];
+    return app->start + app->length <= flash_end
+           && download->start + download->length <= flash_end;
+}
+
+static uint32_t get_download_partition_start(void) {
+    return get_layout()[PFB_PARTITION_DOWNLOAD_SLOT].start;
+}
+
+static uint32_t get_slot_length(void) {
+    return get_layout()[PFB_PARTITION_APPLICATION_SLOT].length;
+}
+
+/**
+ * Returns the maximum length of a swapped image, i.e. the slot without its
+ * 64k tail.
+ */
+static uint32_t get_swap_max_length(void) {
+    return get_slot_length() - PFB_ADDR_AS_U32(__FLASH_SWAP_SCRATCH_LENGTH);
+}
+
+/**
+ * Translates @p tail_addr, given by linker_definitions.ld within the tail of
+ * the application slot (CRC32 tables, boot history and erase counters), into
+ * the layout in use.
+ */
+static uint32_t get_slot_tail_address(uint32_t tail_addr) {
+    return get_app_partition_start() + get_swap_max_length() + tail_addr
+           - PFB_ADDR_AS_U32(__FLASH_CRC_TABLES_START);
+}
+
+#define SLOT_TAIL_ADDRESS(Symbol) get_slot_tail_address(PFB_ADDR_AS_U32(Symbol))
+
+static const pfb_info_header_t *get_info_header(uint32_t copy_start) {
+    return (const pfb_info_header_t *) (copy_start
+                                        + PFB_ADDR_AS_U32(__FLASH_INFO_HEADER)
+                                        - PFB_ADDR_AS_U32(__FLASH_INFO_START));
+}
+
+static bool is_info_copy_valid(uint32_t copy_start) {
+    const pfb_info_header_t *header = get_info_header(copy_start);
+    return header->magic == PFB_INFO_COPY_MAGIC
+           && header->crc
+                      == get_info_copy_crc32(copy_start, header->sequence);
+}
+
+/**
+ * Returns the XIP address of the info copy in use, i.e. the valid copy with
+ * the newer sequence number. The factory copy programmed with the bootloader
+ * wins until the first compaction retires it.
+ */
+static uint32_t get_info_copy_start(void) {
+    if (g_info_copy_start) {
+        return g_info_copy_start;
+    }
+
+    uint32_t primary = PFB_ADDR_AS_U32(__FLASH_INFO_START);
+    uint32_t mirror = PFB_ADDR_AS_U32(__FLASH_INFO_MIRROR_START);
+    g_info_copy_start = primary;
+    if (get_info_header(primary)->magic != PFB_INFO_COPY_FACTORY_MAGIC
+        && is_info_copy_valid(mirror)
+        && (!is_info_copy_valid(primary)
+            || (int32_t) (get_info_header(mirror)->sequence
+                          - get_info_header(primary)->sequence)
+                       > 0)) {
+        g_info_copy_start = mirror;
+    }
+    return g_info_copy_start;
+}
+
+/**
+ * Translates @p info_addr, given by linker_definitions.ld within the
+ * __FLASH_INFO_START sector, into the info copy in use.
+ */
+static uint32_t get_info_copy_address(uint32_t info_addr) {
+    return get_info_copy_start() + info_addr
+           - PFB_ADDR_AS_U32(__FLASH_INFO_START);
+}
+
+/**
+ * Programs @p len bytes of @p data within a single flash page. Bytes left as
+ * 0xff are not modified by programming, so only the new data lands in flash.
+ */
+static void program_within_page_isr_unsafe(uint32_t dest_addr_with_xip_offset,
+                                           const void *data,
+                                           size_t len) {
+    uint32_t page_addr = dest_addr_with_xip_offset
+                         - dest_addr_with_xip_offset % FLASH_PAGE_SIZE;
+    uint8_t page[FLASH_PAGE_SIZE];
+
+    assert(dest_addr_with_xip_offset + len <= page_addr + FLASH_PAGE_SIZE);
+    memset(page, 0xff, sizeof(page));
+    memcpy(page + dest_addr_with_xip_offset - page_addr, data, len);
+    flash_range_program(page_addr, page, FLASH_PAGE_SIZE);
+}
+
+static uint32_t get_words_checksum(uint32_t seed,
+                                   const void *data,
+                                   size_t len) {
+    const uint32_t *words = (const uint32_t *) data;
+    uint32_t checksum = seed;
+    for (size_t i = 0; i < len / sizeof(uint32_t); i++) {
+        checksum = (checksum << 1 | checksum >> 31) ^ words[i];
+    }
+    return checksum;
+}
+
+/**
+ * Erases counted since the last snapshot. An erase pass of a region ends once
+ * one of its sectors is erased again, so the number of passes bounds the erase
+ * count of every sector of the region, while e.g. a swap erasing each sector of
+ * a block once adds just one to its counter.
+ */
+static struct {
+    uint16_t pass_sectors;
+    uint16_t passes;
+} g_erase_pending[PFB_ERASE_REGION_COUNT];
+
+/**
+ * Returns the erase counter region of the sector at @p addr, or -1 if erases
+ * of the sector are not counted. @p out_sector_bit is set to the bit of the
+ * sector within the region.
+ */
+static int get_erase_region(uint32_t addr, uint16_t *out_sector_bit) {
+    uint32_t app_start = get_app_partition_start();
+    uint32_t download_start = get_download_partition_start();
+    uint32_t slot_length = get_slot_length();
+
+    // Both copies of the info sector are counted together.
+    bool is_primary = addr / FLASH_SECTOR_SIZE
+                      == PFB_ADDR_AS_U32(__FLASH_INFO_START) / FLASH_SECTOR_SIZE;
+    if (is_primary
+        || addr / FLASH_SECTOR_SIZE
+                   == PFB_ADDR_AS_U32(__FLASH_INFO_MIRROR_START)
+                              / FLASH_SECTOR_SIZE) {
+        *out_sector_bit = is_primary ? 1 : 2;
+        return PFB_ERASE_REGION_INFO;
+    }
+
+    int region;
+    uint32_t offset;
+    if (addr >= app_start && addr < app_start + slot_length) {
+        region = PFB_ERASE_REGION_APPLICATION_SLOT;
+        offset = addr - app_start;
+    } else if (addr >= download_start && addr < download_start + slot_length) {
+        region = PFB_ERASE_REGION_DOWNLOAD_SLOT;
+        offset = addr - download_start;
+    } else {
+        return -1;
+    }
+    *out_sector_bit =
+            (uint16_t) (1u << (offset % FLASH_BLOCK_SIZE / FLASH_SECTOR_SIZE));
+    return region + (int) (offset / FLASH_BLOCK_SIZE);
+}
+
+/**
+ * Erases @p len bytes of flash, counting the erase of every sector. The
+ * counters are only kept in RAM, see _pfb_erase_counters_flush().
+ */
+void _pfb_flash_range_erase(uint32_t addr_with_xip_offset, size_t len) {
+    flash_range_erase(addr_with_xip_offset, len);
+
+    for (uint32_t addr = XIP_BASE + addr_with_xip_offset;
+         addr < XIP_BASE + addr_with_xip_offset + len;
+         addr += FLASH_SECTOR_SIZE) {
+        uint16_t sector_bit;
+        int region = get_erase_region(addr, &sector_bit);
+        if (region < 0) {
+            continue;
+        }
+        if (g_erase_pending[region].pass_sectors & sector_bit) {
+            g_erase_pending[region].passes++;
+            g_erase_pending[region].pass_sectors = 0;
+        }
+        g_erase_pending[region].pass_sectors |= sector_bit;
+    }
+}
+
+static const pfb_erase_snapshot_t *get_erase_snapshots(uint32_t sector) {
+    return (const pfb_erase_snapshot_t *) (SLOT_TAIL_ADDRESS(
+                                                   __FLASH_ERASE_COUNTERS_START)
+                                           + sector * FLASH_SECTOR_SIZE);
+}
+
+static const pfb_erase_snapshot_t *get_erase_snapshot(uint32_t sector,
+                                                      size_t index) {
+    return (const pfb_erase_snapshot_t *) ((uint32_t) get_erase_snapshots(
+                                                   sector)
+                                           + index * PFB_ERASE_SNAPSHOT_SIZE);
+}
+
+static bool is_erase_snapshot_valid(const pfb_erase_snapshot_t *snapshot) {
+    return snapshot->sequence != PFB_ERASE_SNAPSHOT_ERASED_SEQUENCE
+           && snapshot->checksum
+                      == get_words_checksum(snapshot->sequence,
+                                            snapshot->counts,
+                                            sizeof(snapshot->counts));
+}
+
+/**
+ * Returns the newest valid snapshot of the erase counters, or NULL if there is
+ * none. @p out_sector and @p out_index are set to its position, or to the
+ * position before the first snapshot.
+ */
+static const pfb_erase_snapshot_t *find_erase_snapshot(uint32_t *out_sector,
+                                                       int *out_index) {
+    const pfb_erase_snapshot_t *newest = NULL;
+    *out_sector = 0;
+    *out_index = -1;
+
+    for (uint32_t sector = 0; sector < 2; sector++) {
+        for (int i = PFB_ERASE_SNAPSHOTS_PER_SECTOR - 1; i >= 0; i--) {
+            const pfb_erase_snapshot_t *snapshot =
+                    get_erase_snapshot(sector, (size_t) i);
+            if (!is_erase_snapshot_valid(snapshot)) {
+                continue;
+            }
+            if (!newest
+                || (int32_t) (snapshot->sequence - newest->sequence) > 0) {
+                newest = snapshot;
+                *out_sector = sector;
+                *out_index = i;
+            }
+            break;
+        }
+    }
+    return newest;
+}
+
+static uint32_t get_pending_erase_passes(int region) {
+    return g_erase_pending[region].passes
+           + (g_erase_pending[region].pass_sectors ? 1 : 0);
+}
+
+static void load_erase_counts(uint32_t counts[PFB_ERASE_REGION_COUNT]) {
+    uint32_t sector;
+    int index;
+    const pfb_erase_snapshot_t *snapshot = find_erase_snapshot(&sector, &index);
+
+    for (int region = 0; region < PFB_ERASE_REGION_COUNT; region++) {
+        counts[region] = (snapshot ? snapshot->counts[region] : 0)
+                         + get_pending_erase_passes(region);
+    }
+}
+
+/**
+ * Appends a snapshot of the erase counters if any erase has been counted since
+ * the last one. Once the sector of the newest snapshot is full, the other
+ * sector is erased and used instead. Erases which are not flushed before a
+ * reset are lost, so the counters may fall slightly behind.
+ */
+void _pfb_erase_counters_flush(void) {
+    bool has_pending = false;
+    for (int region = 0; region < PFB_ERASE_REGION_COUNT; region++) {
+        has_pending |= get_pending_erase_passes(region) > 0;
+    }
+    if (!has_pending) {
+        return;
+    }
+
+    uint32_t sector;
+    int last;
+    const pfb_erase_snapshot_t *newest = find_erase_snapshot(&sector, &last);
+    uint32_t sequence = newest ? newest->sequence + 1 : 1;
+    size_t index = (size_t) (last + 1);
+    // Snapshots torn by a power loss are skipped, as programming over them
+    // could make them look valid.
+    while (index < PFB_ERASE_SNAPSHOTS_PER_SECTOR
+           && get_erase_snapshot(sector, index)->sequence
+                      != PFB_ERASE_SNAPSHOT_ERASED_SEQUENCE) {
+        index++;
+    }
+
+    uint32_t saved_interrupts = save_and_disable_interrupts();
+    if (index == PFB_ERASE_SNAPSHOTS_PER_SECTOR) {
+        sector = 1 - sector;
+        index = 0;
+        // Counted before the snapshot is taken, so it includes this erase.
+        _pfb_flash_range_erase((uint32_t) get_erase_snapshots(sector)
+                                       - XIP_BASE,
+                               FLASH_SECTOR_SIZE);
+    }
+
+    // Static, as with big flash parts it takes a few pages.
+    static uint32_t buffer[PFB_ERASE_SNAPSHOT_SIZE / sizeof(uint32_t)];
+    pfb_erase_snapshot_t *snapshot = (pfb_erase_snapshot_t *) buffer;
+    memset(buffer, 0xff, sizeof(buffer));
+    snapshot->sequence = sequence;
+    for (int region = 0; region < PFB_ERASE_REGION_COUNT; region++) {
+        snapshot->counts[region] = (newest ? newest->counts[region] : 0)
+                                   + get_pending_erase_passes(region);
+    }
+    snapshot->checksum = get_words_checksum(snapshot->sequence,
+                                            snapshot->counts,
+                                            sizeof(snapshot->counts));
+    flash_range_program((uint32_t) get_erase_snapshot(sector, index) - XIP_BASE,
+                        (const uint8_t *) buffer, sizeof(buffer));
+    memset(g_erase_pending, 0, sizeof(g_erase_pending));
+    restore_interrupts(saved_interrupts);
+}
+
+static uint16_t get_info_field_index(uint32_t field_addr) {
+    return (uint16_t) ((field_addr - PFB_ADDR_AS_U32(__FLASH_INFO_START))
+                       / sizeof(uint32_t));
+}
+
+static uint16_t get_info_record_check(uint16_t field, uint32_t value) {
+    return (uint16_t) ~(field ^ value ^ (value >> 16));
+}
+
+static uint16_t get_info_record_tag(size_t index) {
+    return (uint16_t) (index << PFB_INFO_RECORD_TAG_SHIFT);
+}
+
+static const pfb_info_record_t *get_info_log(void) {
+    return (const pfb_info_record_t *) get_info_copy_address(
+            PFB_ADDR_AS_U32(__FLASH_INFO_LOG));
+}
+
+static size_t get_info_log_capacity(void) {
+    return PFB_ADDR_AS_U32(__FLASH_INFO_LOG_LENGTH) / sizeof(pfb_info_record_t);
+}
+
+static bool is_info_record_erased(const pfb_info_record_t *record) {
+    return record->field == PFB_INFO_RECORD_ERASED_FIELD
+           && record->check == PFB_INFO_RECORD_ERASED_FIELD
+           && record->value == 0xffffffff;
+}
+
+static bool is_info_record_valid(const pfb_info_record_t *record) {
+    return record->check == get_info_record_check(record->field, record->value)
+           && (record->field & PFB_INFO_RECORD_INDEX_MASK)
+                      < PFB_INFO_FIELD_COUNT;
+}
+
+/**
+ * Returns the number of used records. Records torn by a power loss fail the
+ * check and are skipped by the readers, but still take their place.
+ */
+static size_t info_log_first_free_index(void) {
+    const pfb_info_record_t *log = get_info_log();
+    size_t capacity = get_info_log_capacity();
+    size_t index = 0;
+
+    while (index < capacity && !is_info_record_erased(&log[index])) {
+        index++;
+    }
+    return index;
+}
+
+/**
+ * Resolves the base values and the complete groups of the info log into the
+ * current values of all the info fields.
+ */
+static void load_info_fields(uint32_t values[PFB_INFO_FIELD_COUNT]) {
+    const pfb_info_record_t *log = get_info_log();
+    size_t capacity = get_info_log_capacity();
+    uint32_t group_values[PFB_INFO_FIELD_COUNT];
+    uint32_t group_fields = 0;
+    uint16_t group_tag = 0;
+    bool is_in_group = false;
+
+    memcpy(values, (const void *) get_info_copy_start(),
+           PFB_INFO_FIELD_COUNT * sizeof(uint32_t));
+    for (size_t i = 0; i < capacity && !is_info_record_erased(&log[i]); i++) {
+        uint16_t field = log[i].field;
+        bool is_valid = is_info_record_valid(&log[i]);
+
+        if (is_in_group
+            && (!is_valid
+                || (field & PFB_INFO_RECORD_TAG_MASK) != group_tag)) {
+            // The group has been torn, none of its records apply.
+            is_in_group = false;
+        }
+        if (!is_valid) {
+            continue;
+        }
+        if (!is_in_group) {
+            group_tag = get_info_record_tag(i);
+            if ((field & PFB_INFO_RECORD_TAG_MASK) != group_tag) {
+                // Remainder of a torn group.
+                continue;
+            }
+            group_fields = 0;
+            is_in_group = true;
+        }
+
+        uint16_t index = field & PFB_INFO_RECORD_INDEX_MASK;
+        group_values[index] = log[i].value;
+        group_fields |= 1u << index;
+        if (!(field & PFB_INFO_RECORD_CONTINUES)) {
+            for (uint16_t j = 0; j < PFB_INFO_FIELD_COUNT; j++) {
+                if (group_fields & (1u << j)) {
+                    values[j] = group_values[j];
+                }
+            }
+            is_in_group = false;
+        }
+    }
+}
+
+static uint32_t read_info_field(uint32_t field_addr) {
+    uint16_t index = get_info_field_index(field_addr);
+    if (g_info_transaction.depth > 0) {
+        return g_info_transaction.values[index];
+    }
+
+    uint32_t values[PFB_INFO_FIELD_COUNT];
+    load_info_fields(values);
+    return values[index];
+}
+
+#define READ_INFO_FIELD(Field) read_info_field(PFB_ADDR_AS_U32(Field))
+
+/**
+ * Writes the spare info copy with a base page holding @p values and switches
+ * to it. The copy in use is left intact until the new one is complete, so
+ * a power loss in the middle keeps the current state. The new copy starts with
+ * an empty swap journal, so it must not be called in the middle of a swap.
+ */
+static void
+compact_info_isr_unsafe(const uint32_t values[PFB_INFO_FIELD_COUNT]) {
+    uint32_t current = get_info_copy_start();
+    uint32_t spare = current == PFB_ADDR_AS_U32(__FLASH_INFO_START)
+                             ? PFB_ADDR_AS_U32(__FLASH_INFO_MIRROR_START)
+                             : PFB_ADDR_AS_U32(__FLASH_INFO_START);
+    const pfb_info_header_t *current_header = get_info_header(current);
+    uint32_t base[FLASH_PAGE_SIZE / sizeof(uint32_t)];
+    memset(base, 0xff, sizeof(base));
+    memcpy(base, values, PFB_INFO_FIELD_COUNT * sizeof(uint32_t));
+
+    pfb_info_header_t header = {
+        .magic = PFB_INFO_COPY_MAGIC,
+        .sequence = current_header->magic == PFB_INFO_COPY_MAGIC
+                            ? current_header->sequence + 1
+                            : 1,
+    };
+    header.crc = get_info_copy_crc32((uint32_t) base, header.sequence);
+    memcpy((uint8_t *) base + PFB_ADDR_AS_U32(__FLASH_INFO_HEADER)
+                   - PFB_ADDR_AS_U32(__FLASH_INFO_START),
+           &header, sizeof(header));
+
+    _pfb_flash_range_erase(spare - XIP_BASE, FLASH_SECTOR_SIZE);
+    flash_range_program(spare - XIP_BASE, (const uint8_t *) base,
+                        FLASH_PAGE_SIZE);
+    if (current_header->magic == PFB_INFO_COPY_FACTORY_MAGIC) {
+        uint32_t retired_magic = PFB_INFO_COPY_RETIRED_MAGIC;
+        program_within_page_isr_unsafe(
+                (uint32_t) &current_header->magic - XIP_BASE, &retired_magic,
+                sizeof(retired_magic));
+    }
+    g_info_copy_start = spare;
+}
+
+static void append_info_records_isr_unsafe(size_t index,
+                                           const pfb_info_record_t *records,
+                                           size_t count) {
+    while (count > 0) {
+        uint32_t dest_addr =
+                get_info_copy_address(PFB_ADDR_AS_U32(__FLASH_INFO_LOG))
+                - XIP_BASE + index * sizeof(*records);
+        size_t chunk = (FLASH_PAGE_SIZE - dest_addr % FLASH_PAGE_SIZE)
+                       / sizeof(*records);
+        if (chunk > count) {
+            chunk = count;
+        }
+
+        program_within_page_isr_unsafe(dest_addr, records,
+                                       chunk * sizeof(*records));
+        index += chunk;
+        records += chunk;
+        count -= chunk;
+    }
+}
+
+void pfb_info_begin(void) {
+    if (g_info_transaction.depth++ == 0) {
+        load_info_fields(g_info_transaction.values);
+        g_info_transaction.changed_fields = 0;
+    }
+}
+
+void pfb_info_commit(void) {
+    assert(g_info_transaction.depth > 0);
+    if (--g_info_transaction.depth > 0) {
+        return;
+    }
+    if (g_info_transaction.changed_fields == 0) {
+        _pfb_erase_counters_flush();
+        return;
+    }
+
+    size_t index = info_log_first_free_index();
+    pfb_info_record_t records[PFB_INFO_FIELD_COUNT];
+    size_t count = 0;
+    for (uint16_t field = 0; field < PFB_INFO_FIELD_COUNT; field++) {
+        if (g_info_transaction.changed_fields & (1u << field)) {
+            records[count].field = get_info_record_tag(index) | field
+                                   | PFB_INFO_RECORD_CONTINUES;
+            records[count].value = g_info_transaction.values[field];
+            count++;
+        }
+    }
+    records[count - 1].field &= (uint16_t) ~PFB_INFO_RECORD_CONTINUES;
+    for (size_t i = 0; i < count; i++) {
+        records[i].check =
+                get_info_record_check(records[i].field, records[i].value);
+    }
+
+    uint32_t saved_interrupts = save_and_disable_interrupts();
+    if (index + count > get_info_log_capacity()) {
+        compact_info_isr_unsafe(g_info_transaction.values);
+    } else {
+        append_info_records_isr_unsafe(index, records, count);
+    }
+    restore_interrupts(saved_interrupts);
+    _pfb_erase_counters_flush();
+}
+
+/**
+ * Makes the info field at @p field_addr hold @p value, as a part of the open
+ * transaction or on its own. Fields which already hold the value are not
+ * written at all, so e.g. a boot with nothing to install doesn't program
+ * anything.
+ */
+static void set_info_field(uint32_t field_addr, uint32_t value) {
+    uint16_t index = get_info_field_index(field_addr);
+
+    pfb_info_begin();
+    if (g_info_transaction.values[index] != value) {
+        g_info_transaction.values[index] = value;
+        g_info_transaction.changed_fields |= 1u << index;
+    }
+    pfb_info_commit();
+}
+
+static void mark_download_slot(uint32_t magic) {
+    uint32_t dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_IS_DOWNLOAD_SLOT_VALID);
+
+    set_info_field(dest_addr, magic);
+}
 
-#ifdef PFB_WITH_IMAGE_ENCRYPTION
-mbedtls_aes_context g_aes_ctx;
-#endif // PFB_WITH_IMAGE_ENCRYPTION
+static void mark_download_size(uint32_t size) {
+    uint32_t dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_SWAP_SIZE);
 
-static inline void erase_flash_info_partition_isr_unsafe(void) {
-    flash_range_erase(PFB_ADDR_WITH_XIP_OFFSET_AS_U32(__FLASH_INFO_START),
-                      FLASH_SECTOR_SIZE);
+    set_info_field(dest_addr, size);
 }
 
-static void
-overwrite_4_bytes_in_flash_isr_unsafe(uint32_t dest_addr_with_xip_offset,
-                                      uint32_t data) {
-    uint8_t data_arr_u8[FLASH_SECTOR_SIZE] = {};
-    uint32_t *data_ptr_u32 = (uint32_t *) data_arr_u8;
-    uint32_t erase_start_addr_with_xip_offset =
-            PFB_ADDR_WITH_XIP_OFFSET_AS_U32(__FLASH_INFO_START);
+static void mark_install_mode(uint32_t magic) {
+    uint32_t dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_INSTALL_MODE);
 
-    assert(dest_addr_with_xip_offset >= erase_start_addr_with_xip_offset);
+    set_info_field(dest_addr, magic);
+}
 
-    void *flash_info_start_addr =
-            (void *) (PFB_ADDR_AS_U32(__FLASH_INFO_START));
-    memcpy(data_arr_u8, flash_info_start_addr, FLASH_SECTOR_SIZE);
+#ifdef PFB_WITH_DIRECT_XIP
+static bool is_slot_sequence_valid(uint32_t sequence) {
+    return sequence != PFB_SLOT_SEQUENCE_INVALID
+           && sequence != PFB_SLOT_SEQUENCE_ERASED;
+}
 
-    size_t array_index =
-            (dest_addr_with_xip_offset - erase_start_addr_with_xip_offset)
-            / (sizeof(uint32_t));
-    data_ptr_u32[array_index] = data;
+/**
+ * The active slot is the valid one with the greater sequence number. It's the
+ * slot the bootloader jumps to, and so the slot the application runs from.
+ */
+static bool is_slot_a_active(void) {
+    if (!is_slot_sequence_valid(READ_INFO_FIELD(__FLASH_INFO_SLOT_B_SEQUENCE))) {
+        return true;
+    }
+    if (!is_slot_sequence_valid(READ_INFO_FIELD(__FLASH_INFO_SLOT_A_SEQUENCE))) {
+        return false;
+    }
+    return READ_INFO_FIELD(__FLASH_INFO_SLOT_A_SEQUENCE)
+           >= READ_INFO_FIELD(__FLASH_INFO_SLOT_B_SEQUENCE);
+}
 
-    erase_flash_info_partition_isr_unsafe();
-    flash_range_program(erase_start_addr_with_xip_offset, data_arr_u8,
-                        FLASH_SECTOR_SIZE);
+static uint32_t get_active_slot_sequence(void) {
+    return is_slot_a_active() ? READ_INFO_FIELD(__FLASH_INFO_SLOT_A_SEQUENCE)
+                              : READ_INFO_FIELD(__FLASH_INFO_SLOT_B_SEQUENCE);
 }
 
-static void overwrite_4_bytes_in_flash(uint32_t dest_addr, uint32_t data) {
-    uint32_t saved_interrupts = save_and_disable_interrupts();
-    overwrite_4_bytes_in_flash_isr_unsafe(dest_addr - XIP_BASE, data);
-    restore_interrupts(saved_interrupts);
+static uint32_t get_inactive_slot_sequence(void) {
+    return is_slot_a_active() ? READ_INFO_FIELD(__FLASH_INFO_SLOT_B_SEQUENCE)
+                              : READ_INFO_FIELD(__FLASH_INFO_SLOT_A_SEQUENCE);
 }
 
-static void mark_download_slot(uint32_t magic) {
-    uint32_t dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_IS_DOWNLOAD_SLOT_VALID);
+static void mark_active_slot_sequence(uint32_t sequence) {
+    uint32_t dest_addr =
+            is_slot_a_active() ? PFB_ADDR_AS_U32(__FLASH_INFO_SLOT_A_SEQUENCE)
+                               : PFB_ADDR_AS_U32(__FLASH_INFO_SLOT_B_SEQUENCE);
 
-    overwrite_4_bytes_in_flash(dest_addr, magic);
+    set_info_field(dest_addr, sequence);
 }
 
-static void mark_download_size(uint32_t size) {
-    uint32_t dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_SWAP_SIZE);
+static void mark_inactive_slot_sequence(uint32_t sequence) {
+    uint32_t dest_addr =
+            is_slot_a_active() ? PFB_ADDR_AS_U32(__FLASH_INFO_SLOT_B_SEQUENCE)
+                               : PFB_ADDR_AS_U32(__FLASH_INFO_SLOT_A_SEQUENCE);
+
+    set_info_field(dest_addr, sequence);
+}
+#endif // PFB_WITH_DIRECT_XIP
+
+/**
+ * Returns the XIP address of the slot the application is executed from.
+ */
+static uint32_t get_application_slot_start(void) {
+#ifdef PFB_WITH_DIRECT_XIP
+    if (!is_slot_a_active()) {
+        return get_download_partition_start();
+    }
+#endif // PFB_WITH_DIRECT_XIP
+    return get_app_partition_start();
+}
 
-    overwrite_4_bytes_in_flash(dest_addr, size);
+/**
+ * Returns the XIP address of the slot new images are downloaded into. With
+ * @ref PFB_WITH_DIRECT_XIP it's whichever slot is not active.
+ */
+static uint32_t get_download_slot_start(void) {
+#ifdef PFB_WITH_DIRECT_XIP
+    if (!is_slot_a_active()) {
+        return get_app_partition_start();
+    }
+#endif // PFB_WITH_DIRECT_XIP
+    return get_download_partition_start();
 }
 
 static void notify_pico_about_firmware(uint32_t magic) {
     uint32_t dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_IS_FIRMWARE_SWAPPED);
 
-    overwrite_4_bytes_in_flash(dest_addr, magic);
+    set_info_field(dest_addr, magic);
 }
 
 static void mark_if_should_rollback(uint32_t magic) {
     uint32_t dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_SHOULD_ROLLBACK);
 
-    overwrite_4_bytes_in_flash(dest_addr, magic);
+    set_info_field(dest_addr, magic);
 }
 
 static void mark_if_is_after_rollback(uint32_t magic) {
     uint32_t dest_addr = PFB_ADDR_AS_U32(__FLASH_INFO_IS_AFTER_ROLLBACK);
 
-    overwrite_4_bytes_in_flash(dest_addr, magic);
+    set_info_field(dest_addr, magic);
+}
+
+static const uint16_t *get_swap_journal(void) {
+    return (const uint16_t *) get_info_copy_address(
+            PFB_ADDR_AS_U32(__FLASH_INFO_SWAP_JOURNAL));
 }
 
-static void *get_image_sha256_address(size_t image_size) {
-    return (void *) (PFB_ADDR_AS_U32(__FLASH_DOWNLOAD_SLOT_START) + image_size
-                     - PFB_SHA256_DIGEST_SIZE);
+static size_t get_swap_journal_capacity(void) {
+    return PFB_ADDR_AS_U32(__FLASH_INFO_SWAP_JOURNAL_LENGTH) / sizeof(uint16_t);
+}
+
+static size_t swap_journal_first_free_index(void) {
+    const uint16_t *journal = get_swap_journal();
+    size_t capacity = get_swap_journal_capacity();
+    size_t index = 0;
+
+    while (index < capacity && journal[index] != PFB_SWAP_JOURNAL_EMPTY_ENTRY) {
+        index++;
+    }
+    return index;
+}
+
+static uint32_t get_image_sha256_address(size_t image_size) {
+    return get_download_slot_start() + image_size - PFB_SHA256_DIGEST_SIZE;
 }
 
 #ifdef PFB_WITH_IMAGE_ENCRYPTION
@@ -143,71 +1190,782 @@ static int decrypt_256_bytes(const uint8_t *src, uint8_t *out_dest) {
     }
     return 0;
 }
-#endif // PFB_WITH_IMAGE_ENCRYPTION
+#endif // PFB_WITH_IMAGE_ENCRYPTION
+
+static void start_xip_stream(uint32_t addr, size_t len) {
+    while (!(xip_ctrl_hw->stat & XIP_STAT_FIFO_EMPTY_BITS)) {
+        (void) xip_ctrl_hw->stream_fifo;
+    }
+    xip_ctrl_hw->stream_addr = addr;
+    xip_ctrl_hw->stream_ctr = len / sizeof(uint32_t);
+}
+
+/**
+ * Moves @p len bytes from @p src to @p dest using DMA @p channel, either from
+ * a RAM buffer or, if @p from_xip_stream, from the XIP stream FIFO. If
+ * @p dest is NULL the data is discarded. If @p out_crc is not NULL the DMA
+ * sniffer calculates CRC32 of the data on the fly.
+ */
+static void dma_transfer(int channel,
+                         const volatile void *src,
+                         bool from_xip_stream,
+                         void *dest,
+                         size_t len,
+                         uint32_t *out_crc) {
+    static uint32_t discarded_word;
+
+    dma_channel_config config = dma_channel_get_default_config(channel);
+    channel_config_set_read_increment(&config, !from_xip_stream);
+    channel_config_set_write_increment(&config, dest != NULL);
+    channel_config_set_dreq(&config,
+                            from_xip_stream ? DREQ_XIP_STREAM : DREQ_FORCE);
+    if (out_crc) {
+        channel_config_set_sniff_enable(&config, true);
+        dma_sniffer_enable(channel, DMA_SNIFF_CTRL_CALC_VALUE_CRC32, false);
+        dma_sniffer_set_data_accumulator(PFB_CRC32_SEED);
+    }
+    dma_channel_configure(channel, &config,
+                          dest ? dest : (void *) &discarded_word, src,
+                          len / sizeof(uint32_t), true);
+    dma_channel_wait_for_finish_blocking(channel);
+    if (out_crc) {
+        *out_crc = dma_sniffer_get_data_accumulator();
+        dma_sniffer_disable();
+    }
+}
+
+static bool is_word_aligned(uint32_t addr, const void *buffer, size_t len) {
+    return !(addr % sizeof(uint32_t) || len % sizeof(uint32_t)
+             || (uint32_t) buffer % sizeof(uint32_t));
+}
+
+/**
+ * Reads @p len bytes of flash at @p addr into @p dest using the XIP streaming
+ * interface and a DMA channel. The XIP cache is bypassed, so reading a whole
+ * slot doesn't evict the code being executed and runs close to the QSPI line
+ * rate. Unaligned requests or lack of a free DMA channel fall back to a copy
+ * through the non-caching XIP alias.
+ */
+void _pfb_flash_read(uint32_t addr, void *dest, size_t len) {
+    int channel = dma_claim_unused_channel(false);
+    if (channel < 0 || !is_word_aligned(addr, dest, len)) {
+        if (channel >= 0) {
+            dma_channel_unclaim(channel);
+        }
+        memcpy(dest,
+               (const void *) (XIP_NOCACHE_NOALLOC_BASE + addr - XIP_BASE),
+               len);
+        return;
+    }
+
+    start_xip_stream(addr, len);
+    dma_transfer(channel, (const void *) XIP_AUX_BASE, true, dest, len, NULL);
+    dma_channel_unclaim(channel);
+}
+
+/**
+ * Same as @ref _pfb_flash_read, but also calculates CRC32 of the data with the
+ * DMA sniffer. @p dest may be NULL if only the CRC32 is needed.
+ *
+ * @return true if @p out_crc has been set, false if the CRC32 couldn't be
+ *         calculated, i.e. the request is unaligned or no DMA channel is free.
+ *         @p dest is filled in either case.
+ */
+bool _pfb_flash_read_crc32(uint32_t addr,
+                           void *dest,
+                           size_t len,
+                           uint32_t *out_crc) {
+    int channel = dma_claim_unused_channel(false);
+    if (channel < 0 || !is_word_aligned(addr, dest, len)) {
+        if (channel >= 0) {
+            dma_channel_unclaim(channel);
+        }
+        if (dest) {
+            _pfb_flash_read(addr, dest, len);
+        }
+        return false;
+    }
+
+    start_xip_stream(addr, len);
+    dma_transfer(channel, (const void *) XIP_AUX_BASE, true, dest, len,
+                 out_crc);
+    dma_channel_unclaim(channel);
+    return true;
+}
+
+/**
+ * Calculates CRC32 of a RAM buffer with the DMA sniffer, so that it can be
+ * compared with @ref _pfb_flash_read_crc32 results.
+ */
+static bool ram_crc32(const void *src, size_t len, uint32_t *out_crc) {
+    int channel = dma_claim_unused_channel(false);
+    if (channel < 0 || !is_word_aligned(0, src, len)) {
+        if (channel >= 0) {
+            dma_channel_unclaim(channel);
+        }
+        return false;
+    }
+
+    dma_transfer(channel, src, false, NULL, len, out_crc);
+    dma_channel_unclaim(channel);
+    return true;
+}
+
+static bool flash_page_matches_crc32(uint32_t addr, uint32_t expected_crc) {
+    uint32_t crc;
+    // No CRC32 means no way to tell, so don't fail the write because of it.
+    return !_pfb_flash_read_crc32(addr, NULL, PFB_ALIGN_SIZE, &crc)
+           || crc == expected_crc;
+}
+
+/**
+ * Returns the length of the CRC32 table of a slot, a whole number of sectors.
+ */
+static uint32_t get_crc_table_length(void) {
+    return PFB_ADDR_AS_U32(__FLASH_CRC_TABLES_LENGTH) / 2;
+}
+
+static uint32_t get_crc_table_address(uint32_t slot_start) {
+    uint32_t tables_start = SLOT_TAIL_ADDRESS(__FLASH_CRC_TABLES_START);
+    return slot_start == get_app_partition_start()
+                   ? tables_start
+                   : tables_start + get_crc_table_length();
+}
+
+/**
+ * Returns the RTC time in seconds since the Unix epoch, 0 if the RTC is not
+ * running.
+ */
+static uint32_t get_rtc_timestamp(void) {
+    datetime_t t;
+    if (!rtc_running() || !rtc_get_datetime(&t)) {
+        return 0;
+    }
+
+    // Days from the civil date, March-based so that leap days come last.
+    int32_t year = t.month <= 2 ? t.year - 1 : t.year;
+    int32_t era = year / 400;
+    int32_t year_of_era = year - era * 400;
+    int32_t day_of_year =
+            (153 * (t.month > 2 ? t.month - 3 : t.month + 9) + 2) / 5 + t.day
+            - 1;
+    int32_t day_of_era = year_of_era * 365 + year_of_era / 4
+                         - year_of_era / 100 + day_of_year;
+    int32_t days = era * 146097 + day_of_era - 719468;
+    return (uint32_t) days * 86400 + t.hour * 3600 + t.min * 60 + t.sec;
+}
+
+/**
+ * Set by pfb_initialize_download_slot() until the download is marked as valid
+ * or invalid, so that pfb_scrub_download_slot() never erases the pages which
+ * have just been written.
+ */
+static bool g_is_download_in_progress;
+
+void pfb_mark_download_slot_as_valid(uint32_t swap_len) {
+    pfb_mark_download_slot_as_valid_with_mode(swap_len,
+                                              PFB_DEFAULT_INSTALL_MODE);
+}
+
+static bool is_watchdog_handoff_valid(void) {
+    return watchdog_hw->scratch[PFB_WATCHDOG_SCRATCH_MAGIC]
+           == PFB_WATCHDOG_MAGIC;
+}
+
+static void set_watchdog_flags(uint32_t flags) {
+    watchdog_hw->scratch[PFB_WATCHDOG_SCRATCH_FLAGS] |= flags;
+}
+
+static void clear_watchdog_flags(uint32_t flags) {
+    watchdog_hw->scratch[PFB_WATCHDOG_SCRATCH_FLAGS] &= ~flags;
+}
+
+void pfb_mark_download_slot_as_valid_with_mode(uint32_t swap_len,
+                                               pfb_install_mode_t mode) {
+    // Set before the flash, so that the bootloader never misses the image.
+    set_watchdog_flags(PFB_WATCHDOG_FLAG_INSTALL);
+    if (swap_len==0 || swap_len>get_swap_max_length()) swap_len = get_swap_max_length();
+    swap_len = (swap_len+FLASH_SECTOR_SIZE-1)/FLASH_SECTOR_SIZE*FLASH_SECTOR_SIZE;
+    _pfb_crc_table_store(get_download_slot_start(), swap_len,
+                         get_rtc_timestamp());
+    pfb_info_begin();
+    set_info_field(PFB_ADDR_AS_U32(__FLASH_INFO_DOWNLOAD_SLOT_BLANK),
+                   PFB_DOWNLOAD_SLOT_NOT_BLANK);
+    mark_download_size(swap_len);
+    mark_install_mode(mode == PFB_INSTALL_MODE_COPY
+                              ? PFB_INSTALL_MODE_COPY_MAGIC
+                              : PFB_INSTALL_MODE_SWAP_MAGIC);
+    mark_download_slot(PFB_SHOULD_SWAP_MAGIC);
+    pfb_info_commit();
+    g_is_download_in_progress = false;
+}
+
+void pfb_mark_download_slot_as_invalid(void) {
+    mark_download_slot(PFB_SHOULD_NOT_SWAP_MAGIC);
+    g_is_download_in_progress = false;
+}
+
+bool pfb_is_after_firmware_update(void) {
+    return READ_INFO_FIELD(__FLASH_INFO_IS_FIRMWARE_SWAPPED)
+           == PFB_HAS_NEW_FIRMWARE_MAGIC;
+}
+
+/**
+ * Range of the download slot erased by pfb_initialize_download_slot() and not
+ * programmed since, so that writes into it don't need to erase.
+ */
+static uint32_t g_download_erased_start;
+static uint32_t g_download_erased_end;
+
+/**
+ * Offset of the next sector of the download slot erased by
+ * pfb_scrub_download_slot(), together with the slot it refers to.
+ */
+static struct {
+    uint32_t slot_start;
+    uint32_t offset;
+} g_scrub;
+
+/**
+ * Pages of the open stream waiting for their write batch to be complete. There
+ * is a single download at a time, so one buffer serves every stream and
+ * pfb_stream_t only stages a page.
+ */
+static struct {
+    uint8_t data[PFB_WRITE_BATCH_SIZE]
+            __attribute__((aligned(sizeof(uint32_t))));
+    size_t len;
+} g_stream_batch;
+
+/**
+ * Erases @p len bytes at @p addr_with_xip_offset, both sector-aligned. Every
+ * whole 64 KiB block is erased on its own, using the block erase command, and
+ * the sectors before the first and after the last block are erased together,
+ * using sector erases. Interrupts are enabled between the erases.
+ */
+static void erase_download_range(uint32_t addr_with_xip_offset, size_t len) {
+    uint32_t end = addr_with_xip_offset + len;
+    for (uint32_t addr = addr_with_xip_offset; addr < end;) {
+        uint32_t erase_len = FLASH_BLOCK_SIZE - addr % FLASH_BLOCK_SIZE;
+        if (erase_len > end - addr) {
+            erase_len = end - addr;
+        }
+        uint32_t saved_interrupts = save_and_disable_interrupts();
+        _pfb_flash_range_erase(addr, erase_len);
+        restore_interrupts(saved_interrupts);
+        addr += erase_len;
+    }
+}
+
+/**
+ * Programs @p len bytes of @p src at @p dest_addr_with_xip_offset, within
+ * a single write batch. Sectors starting within the batch are erased first,
+ * unless pfb_initialize_download_slot() has already erased them, and both the
+ * erase and the program are issued once for the whole batch, in a single
+ * window with interrupts disabled.
+ */
+static int write_download_batch(uint32_t dest_addr_with_xip_offset,
+                                const uint8_t *src,
+                                size_t len) {
+    uint32_t crcs[PFB_WRITE_BATCH_SIZE / PFB_ALIGN_SIZE];
+    bool verify = true;
+    for (size_t i = 0; i < len / PFB_ALIGN_SIZE; i++) {
+        verify = verify
+                 && ram_crc32(src + i * PFB_ALIGN_SIZE, PFB_ALIGN_SIZE,
+                              &crcs[i]);
+    }
+
+    uint32_t erase_start = (dest_addr_with_xip_offset + FLASH_SECTOR_SIZE - 1)
+                           / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
+    uint32_t erase_end =
+            (dest_addr_with_xip_offset + len + FLASH_SECTOR_SIZE - 1)
+            / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
+    bool is_erased = erase_start >= g_download_erased_start
+                     && erase_end <= g_download_erased_end;
+    uint32_t saved_interrupts = save_and_disable_interrupts();
+    if (erase_start < erase_end && !is_erased) {
+        _pfb_flash_range_erase(erase_start, erase_end - erase_start);
+    }
+    flash_range_program(dest_addr_with_xip_offset, src, len);
+    restore_interrupts(saved_interrupts);
+    // The sectors up to the end of the batch aren't erased anymore, so
+    // writing them again erases them first.
+    if (erase_end > g_download_erased_start) {
+        g_download_erased_start = erase_end;
+    }
+
+    // Programming only clears bits, so bits which didn't make it the first
+    // time can be programmed again without erasing the rest of the sector.
+    for (size_t i = 0; verify && i < len / PFB_ALIGN_SIZE; i++) {
+        uint32_t page_addr = dest_addr_with_xip_offset + i * PFB_ALIGN_SIZE;
+        for (int retry = 0;
+             !flash_page_matches_crc32(XIP_BASE + page_addr, crcs[i]);
+             retry++) {
+            if (retry == PFB_PROGRAM_RETRIES) {
+                return 1;
+            }
+            saved_interrupts = save_and_disable_interrupts();
+            flash_range_program(page_addr, src + i * PFB_ALIGN_SIZE,
+                                PFB_ALIGN_SIZE);
+            restore_interrupts(saved_interrupts);
+        }
+    }
+    return 0;
+}
+
+#ifdef PFB_WITH_SHA256_HASHING
+/**
+ * SHA256 of the download, calculated while it's written. The last 32 bytes
+ * written so far are held back, as the SHA256 of the image doesn't cover the
+ * digest at its end.
+ */
+static struct {
+    bool is_valid;
+    bool is_finished;
+    size_t written_len;
+    uint8_t tail[PFB_SHA256_DIGEST_SIZE];
+    mbedtls_sha256_context ctx;
+    unsigned char digest[PFB_SHA256_DIGEST_SIZE];
+} g_download_sha256;
+
+static void download_sha256_start(void) {
+    mbedtls_sha256_free(&g_download_sha256.ctx);
+    mbedtls_sha256_init(&g_download_sha256.ctx);
+    g_download_sha256.is_valid =
+            !mbedtls_sha256_starts_ret(&g_download_sha256.ctx, 0);
+    g_download_sha256.is_finished = false;
+    g_download_sha256.written_len = 0;
+}
+
+/**
+ * Feeds @p len bytes written at @p offset into the SHA256 of the download.
+ * Writes which don't continue the download make the SHA256 unusable, so it's
+ * calculated from the flash instead, see pfb_firmware_sha256_check().
+ */
+static void download_sha256_update(size_t offset,
+                                   const uint8_t *data,
+                                   size_t len) {
+    if (!g_download_sha256.is_valid || g_download_sha256.is_finished
+        || offset != g_download_sha256.written_len
+        || len < PFB_SHA256_DIGEST_SIZE) {
+        g_download_sha256.is_valid = false;
+        return;
+    }
+
+    size_t held_len = offset > 0 ? PFB_SHA256_DIGEST_SIZE : 0;
+    if (mbedtls_sha256_update_ret(&g_download_sha256.ctx,
+                                  g_download_sha256.tail, held_len)
+        || mbedtls_sha256_update_ret(&g_download_sha256.ctx, data,
+                                     len - PFB_SHA256_DIGEST_SIZE)) {
+        g_download_sha256.is_valid = false;
+        return;
+    }
+    memcpy(g_download_sha256.tail, data + len - PFB_SHA256_DIGEST_SIZE,
+           PFB_SHA256_DIGEST_SIZE);
+    g_download_sha256.written_len += len;
+}
+
+/**
+ * Finishes the SHA256 of the download, if it covers exactly @p firmware_size
+ * bytes. Returns NULL if it doesn't.
+ */
+static const unsigned char *download_sha256_finish(size_t firmware_size) {
+    if (!g_download_sha256.is_valid
+        || g_download_sha256.written_len != firmware_size) {
+        return NULL;
+    }
+    if (!g_download_sha256.is_finished) {
+        if (mbedtls_sha256_finish_ret(&g_download_sha256.ctx,
+                                      g_download_sha256.digest)) {
+            g_download_sha256.is_valid = false;
+            return NULL;
+        }
+        g_download_sha256.is_finished = true;
+    }
+    return g_download_sha256.digest;
+}
+#endif // PFB_WITH_SHA256_HASHING
+
+int pfb_write_to_flash_aligned_256_bytes(uint8_t *src,
+                                         size_t offset_bytes,
+                                         size_t len_bytes) {
+    if (len_bytes % PFB_ALIGN_SIZE || offset_bytes % PFB_ALIGN_SIZE
+        || offset_bytes + len_bytes
+                   > (size_t) get_swap_max_length()) {
+        return 1;
+    }
+
+    while (len_bytes > 0) {
+        // Batches are aligned within the slot, so that the pages of a sector
+        // are programmed together.
+        size_t batch_len =
+                PFB_WRITE_BATCH_SIZE - offset_bytes % PFB_WRITE_BATCH_SIZE;
+        if (batch_len > len_bytes) {
+            batch_len = len_bytes;
+        }
+#ifdef PFB_WITH_IMAGE_ENCRYPTION
+        static uint8_t batch_dec[PFB_WRITE_BATCH_SIZE]
+                __attribute__((aligned(sizeof(uint32_t))));
+        for (size_t i = 0; i < batch_len / PFB_ALIGN_SIZE; i++) {
+            int ret = decrypt_256_bytes(src + i * PFB_ALIGN_SIZE,
+                                        batch_dec + i * PFB_ALIGN_SIZE);
+            if (ret) {
+                return ret;
+            }
+        }
+        const uint8_t *batch_src = batch_dec;
+#else  // PFB_WITH_IMAGE_ENCRYPTION
+        const uint8_t *batch_src = src;
+#endif // PFB_WITH_IMAGE_ENCRYPTION
+
+        int ret = write_download_batch(get_download_slot_start() - XIP_BASE
+                                               + offset_bytes,
+                                       batch_src, batch_len);
+        if (ret) {
+#ifdef PFB_WITH_SHA256_HASHING
+            g_download_sha256.is_valid = false;
+#endif // PFB_WITH_SHA256_HASHING
+            return ret;
+        }
+#ifdef PFB_WITH_SHA256_HASHING
+        download_sha256_update(offset_bytes, batch_src, batch_len);
+#endif // PFB_WITH_SHA256_HASHING
+        src += batch_len;
+        offset_bytes += batch_len;
+        len_bytes -= batch_len;
+    }
+    return 0;
+}
+
+
+int pfb_initialize_download_slot(size_t image_size, uint32_t *out_erase_us) {
+    if (!is_layout_in_flash() || image_size > (size_t) get_swap_max_length()) {
+        return 1;
+    }
+
+    // A slot scrubbed in the background is written from scratch, and so
+    // is no longer blank.
+    bool is_blank = READ_INFO_FIELD(__FLASH_INFO_DOWNLOAD_SLOT_BLANK)
+                    == get_download_slot_start();
+    g_scrub.offset = 0;
+    g_is_download_in_progress = true;
+
+    pfb_info_begin();
+    pfb_firmware_commit();
+#ifdef PFB_WITH_DIRECT_XIP
+    // The slot is about to be overwritten, make sure it's never booted until
+    // the new image is complete.
+    if (get_inactive_slot_sequence() != PFB_SLOT_SEQUENCE_INVALID) {
+        mark_inactive_slot_sequence(PFB_SLOT_SEQUENCE_INVALID);
+    }
+#endif // PFB_WITH_DIRECT_XIP
+    set_info_field(PFB_ADDR_AS_U32(__FLASH_INFO_DOWNLOAD_SLOT_BLANK),
+                   PFB_DOWNLOAD_SLOT_NOT_BLANK);
+    pfb_info_commit();
+    _pfb_crc_table_invalidate(get_download_slot_start());
+
+    uint64_t erase_start_us = time_us_64();
+    uint32_t erase_start = get_download_slot_start() - XIP_BASE;
+    uint32_t erase_len = (image_size + FLASH_SECTOR_SIZE - 1)
+                         / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
+    if (is_blank) {
+        erase_len = get_swap_max_length();
+    } else {
+        erase_download_range(erase_start, erase_len);
+    }
+    g_download_erased_start = erase_start;
+    g_download_erased_end = erase_start + erase_len;
+    if (out_erase_us) {
+        *out_erase_us = (uint32_t) (time_us_64() - erase_start_us);
+    }
+#ifdef PFB_WITH_SHA256_HASHING
+    download_sha256_start();
+#endif // PFB_WITH_SHA256_HASHING
+#ifdef PFB_WITH_IMAGE_ENCRYPTION
+    mbedtls_aes_free(&g_aes_ctx);
+    mbedtls_aes_init(&g_aes_ctx);
+    int ret = mbedtls_aes_setkey_dec(&g_aes_ctx, (const unsigned char*)PFB_AES_KEY,
+                                     strlen(PFB_AES_KEY) * 8);
+    if (ret) {
+        return ret;
+    }
+#endif // PFB_WITH_IMAGE_ENCRYPTION
+
+    return 0;
+}
+
+int pfb_stream_open(pfb_stream_t *stream,
+                    size_t image_size,
+                    uint32_t *out_erase_us) {
+    stream->offset = 0;
+    stream->staged = 0;
+    g_stream_batch.len = 0;
+    stream->error = pfb_initialize_download_slot(image_size, out_erase_us);
+    return stream->error;
+}
+
+static void stream_write_batches(pfb_stream_t *stream,
+                                 const uint8_t *data,
+                                 size_t len) {
+    stream->error = pfb_write_to_flash_aligned_256_bytes((uint8_t *) data,
+                                                         stream->offset, len);
+    stream->offset += len;
+}
+
+/**
+ * Appends whole pages to the pending batch, writing it out whenever it's
+ * complete.
+ */
+static void stream_append_pages(pfb_stream_t *stream,
+                                const uint8_t *data,
+                                size_t len) {
+    while (!stream->error && len > 0) {
+        size_t chunk = PFB_WRITE_BATCH_SIZE - g_stream_batch.len;
+        if (chunk > len) {
+            chunk = len;
+        }
+        memcpy(g_stream_batch.data + g_stream_batch.len, data, chunk);
+        g_stream_batch.len += chunk;
+        data += chunk;
+        len -= chunk;
+        if (g_stream_batch.len == PFB_WRITE_BATCH_SIZE) {
+            g_stream_batch.len = 0;
+            stream_write_batches(stream, g_stream_batch.data,
+                                 PFB_WRITE_BATCH_SIZE);
+        }
+    }
+}
+
+int pfb_stream_write(pfb_stream_t *stream, const uint8_t *data, size_t len) {
+    if (stream->error) {
+        return stream->error;
+    }
+
+    // The staged page always follows the pending batch, which starts at
+    // a batch boundary, as the stream only writes whole batches until it's
+    // closed.
+    if (stream->staged > 0) {
+        size_t chunk = PFB_ALIGN_SIZE - stream->staged;
+        if (chunk > len) {
+            chunk = len;
+        }
+        memcpy(stream->buffer + stream->staged, data, chunk);
+        stream->staged += chunk;
+        data += chunk;
+        len -= chunk;
+        if (stream->staged < PFB_ALIGN_SIZE) {
+            return 0;
+        }
+        stream->staged = 0;
+        stream_append_pages(stream, stream->buffer, PFB_ALIGN_SIZE);
+    }
+
+    size_t pages_len = len - len % PFB_ALIGN_SIZE;
+    if (g_stream_batch.len > 0) {
+        size_t chunk = PFB_WRITE_BATCH_SIZE - g_stream_batch.len;
+        if (chunk > pages_len) {
+            chunk = pages_len;
+        }
+        stream_append_pages(stream, data, chunk);
+        data += chunk;
+        len -= chunk;
+        pages_len -= chunk;
+    }
+
+    // Pages are verified using the DMA sniffer, which needs them word-aligned,
+    // so only aligned chunks are written in place.
+    size_t batches_len = pages_len - pages_len % PFB_WRITE_BATCH_SIZE;
+    if (!stream->error && batches_len > 0
+        && (uint32_t) data % sizeof(uint32_t) == 0) {
+        stream_write_batches(stream, data, batches_len);
+        data += batches_len;
+        len -= batches_len;
+        pages_len -= batches_len;
+    }
+    stream_append_pages(stream, data, pages_len);
+    data += pages_len;
+    len -= pages_len;
+
+    if (!stream->error) {
+        memcpy(stream->buffer, data, len);
+        stream->staged = len;
+    }
+    return stream->error;
+}
+
+int pfb_stream_close(pfb_stream_t *stream, size_t *out_image_size) {
+    size_t image_size = stream->offset + g_stream_batch.len + stream->staged;
+    if (!stream->error && stream->staged > 0) {
+        memset(stream->buffer + stream->staged, 0xff,
+               PFB_ALIGN_SIZE - stream->staged);
+        stream->staged = 0;
+        stream_append_pages(stream, stream->buffer, PFB_ALIGN_SIZE);
+    }
+    if (!stream->error && g_stream_batch.len > 0) {
+        size_t batch_len = g_stream_batch.len;
+        g_stream_batch.len = 0;
+        stream_write_batches(stream, g_stream_batch.data, batch_len);
+    }
+    *out_image_size = image_size;
+    return stream->error;
+}
+
+/**
+ * Returns true if @p len bytes of flash at @p addr are erased. The flash is
+ * read a page at a time with _pfb_flash_read(), so that scanning a whole block
+ * doesn't evict the application from the XIP cache.
+ */
+static bool is_flash_range_blank(uint32_t addr, uint32_t len) {
+    uint32_t page[PFB_ALIGN_SIZE / sizeof(uint32_t)];
+    for (uint32_t offset = 0; offset < len; offset += PFB_ALIGN_SIZE) {
+        _pfb_flash_read(addr + offset, page, PFB_ALIGN_SIZE);
+        for (size_t i = 0; i < PFB_ALIGN_SIZE / sizeof(uint32_t); i++) {
+            if (page[i] != 0xffffffff) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int pfb_scrub_download_slot(void) {
+    uint32_t slot_start = get_download_slot_start();
+    if (READ_INFO_FIELD(__FLASH_INFO_DOWNLOAD_SLOT_BLANK) == slot_start) {
+        return 0;
+    }
+    // The slot is being downloaded into, or holds either an image waiting to
+    // be installed or the image a rollback would restore.
+    if (!is_layout_in_flash() || g_is_download_in_progress
+        || READ_INFO_FIELD(__FLASH_INFO_IS_DOWNLOAD_SLOT_VALID)
+                   == PFB_SHOULD_SWAP_MAGIC
+        || READ_INFO_FIELD(__FLASH_INFO_SHOULD_ROLLBACK)
+                   == PFB_SHOULD_ROLLBACK_MAGIC) {
+        return -1;
+    }
+
+    if (g_scrub.slot_start != slot_start) {
+        g_scrub.slot_start = slot_start;
+        g_scrub.offset = 0;
+    }
+    if (g_scrub.offset == 0) {
+#ifdef PFB_WITH_DIRECT_XIP
+        if (get_inactive_slot_sequence() != PFB_SLOT_SEQUENCE_INVALID) {
+            mark_inactive_slot_sequence(PFB_SLOT_SEQUENCE_INVALID);
+        }
+#endif // PFB_WITH_DIRECT_XIP
+        _pfb_crc_table_invalidate(slot_start);
+    }
+
+    // A single erase command per call, so that the time spent with
+    // interrupts disabled is bounded by a block erase. Sectors already blank,
+    // e.g. when the scrub is resumed after a reboot, are not erased again.
+    uint32_t addr = slot_start + g_scrub.offset;
+    uint32_t erase_len = FLASH_SECTOR_SIZE;
+    if (addr % FLASH_BLOCK_SIZE == 0
+        && get_swap_max_length() - g_scrub.offset >= FLASH_BLOCK_SIZE) {
+        erase_len = FLASH_BLOCK_SIZE;
+    }
+    if (!is_flash_range_blank(addr, erase_len)) {
+        erase_download_range(addr - XIP_BASE, erase_len);
+    }
+    g_scrub.offset += erase_len;
+    if (g_scrub.offset < get_swap_max_length()) {
+        return 1;
+    }
+
+    g_scrub.offset = 0;
+    set_info_field(PFB_ADDR_AS_U32(__FLASH_INFO_DOWNLOAD_SLOT_BLANK),
+                   slot_start);
+    return 0;
+}
 
-void pfb_mark_download_slot_as_valid(uint32_t swap_len) {
-    if (swap_len==0 || swap_len>PFB_ADDR_AS_U32(__FLASH_SWAP_SPACE_LENGTH)) swap_len = PFB_ADDR_AS_U32(__FLASH_SWAP_SPACE_LENGTH);
-    swap_len = (swap_len+FLASH_SECTOR_SIZE-1)/FLASH_SECTOR_SIZE*FLASH_SECTOR_SIZE;
-    mark_download_size(swap_len);
-    mark_download_slot(PFB_SHOULD_SWAP_MAGIC);
+bool pfb_needs_download_slot_image(void) {
+#ifdef PFB_WITH_DIRECT_XIP
+    return is_slot_a_active();
+#else  // PFB_WITH_DIRECT_XIP
+    return false;
+#endif // PFB_WITH_DIRECT_XIP
+}
 
+int pfb_application_slot_crc_audit(void) {
+    return _pfb_crc_table_audit(get_application_slot_start());
 }
 
-void pfb_mark_download_slot_as_invalid(void) {
-    mark_download_slot(PFB_SHOULD_NOT_SWAP_MAGIC);
+static const pfb_slot_descriptor_t *get_slot_descriptor(uint32_t slot_start) {
+    return (const pfb_slot_descriptor_t *) (get_crc_table_address(slot_start)
+                                            + get_crc_table_length()
+                                            - sizeof(pfb_slot_descriptor_t));
 }
 
-bool pfb_is_after_firmware_update(void) {
-    return (__FLASH_INFO_IS_FIRMWARE_SWAPPED == PFB_HAS_NEW_FIRMWARE_MAGIC);
+/**
+ * Looks for the trailer of the image within the last sector of @p size bytes
+ * of the slot, as sizes kept in the flash info are rounded up to sectors.
+ */
+static const pfb_image_trailer_t *find_image_trailer(uint32_t slot_start,
+                                                     uint32_t size) {
+    uint32_t end = slot_start
+                   + (size + PFB_ALIGN_SIZE - 1) / PFB_ALIGN_SIZE
+                             * PFB_ALIGN_SIZE;
+    for (uint32_t i = 1; i <= FLASH_SECTOR_SIZE / PFB_ALIGN_SIZE; i++) {
+        if (end < slot_start + i * PFB_ALIGN_SIZE) {
+            break;
+        }
+
+        const pfb_image_trailer_t *trailer =
+                (const pfb_image_trailer_t *) (end - i * PFB_ALIGN_SIZE);
+        if (trailer->magic == PFB_IMAGE_TRAILER_MAGIC
+            && trailer->image_size == end - i * PFB_ALIGN_SIZE - slot_start) {
+            return trailer;
+        }
+    }
+    return NULL;
 }
 
-int pfb_write_to_flash_aligned_256_bytes(uint8_t *src,
-                                         size_t offset_bytes,
-                                         size_t len_bytes) {
-    if (len_bytes % PFB_ALIGN_SIZE || offset_bytes % PFB_ALIGN_SIZE
-        || offset_bytes + len_bytes
-                   > (size_t) PFB_ADDR_AS_U32(__FLASH_SWAP_SPACE_LENGTH)) {
+static int read_slot_descriptor(uint32_t slot_start,
+                                pfb_image_descriptor_t *out_descriptor) {
+    const pfb_slot_descriptor_t *slot_descriptor =
+            get_slot_descriptor(slot_start);
+    if (*(const uint32_t *) get_crc_table_address(slot_start)
+                != PFB_CRC_TABLE_MAGIC
+        || slot_descriptor->magic != PFB_IMAGE_DESCRIPTOR_MAGIC
+        || slot_descriptor->checksum
+                   != get_words_checksum(PFB_IMAGE_DESCRIPTOR_MAGIC,
+                                         &slot_descriptor->descriptor,
+                                         sizeof(pfb_image_descriptor_t))) {
         return 1;
     }
 
-    for (int i = 0; i < (int)len_bytes / PFB_ALIGN_SIZE; i++) {
-#ifdef PFB_WITH_IMAGE_ENCRYPTION
-        unsigned char output_aes_dec[PFB_ALIGN_SIZE];
-        int ret = decrypt_256_bytes(src + i * PFB_ALIGN_SIZE, output_aes_dec);
-        if (ret) {
-            return ret;
-        }
-#endif // PFB_WITH_IMAGE_ENCRYPTION
-        uint32_t dest_address =
-                PFB_ADDR_WITH_XIP_OFFSET_AS_U32(__FLASH_DOWNLOAD_SLOT_START)
-                + offset_bytes + i * PFB_ALIGN_SIZE;
-        uint8_t *src_address =
-#ifdef PFB_WITH_IMAGE_ENCRYPTION
-                output_aes_dec;
-#else  // PFB_WITH_IMAGE_ENCRYPTION
-                src + i * PFB_ALIGN_SIZE;
-#endif // PFB_WITH_IMAGE_ENCRYPTION
-        uint32_t saved_interrupts = save_and_disable_interrupts();
-        if (dest_address % FLASH_SECTOR_SIZE == 0) flash_range_erase(dest_address, PFB_ALIGN_SIZE);
-        flash_range_program(dest_address, src_address, PFB_ALIGN_SIZE);
-        restore_interrupts(saved_interrupts);
-    }
+    *out_descriptor = slot_descriptor->descriptor;
     return 0;
 }
 
+int pfb_get_application_slot_descriptor(
+        pfb_image_descriptor_t *out_descriptor) {
+    return read_slot_descriptor(get_application_slot_start(), out_descriptor);
+}
 
-int pfb_initialize_download_slot() {
-    pfb_firmware_commit();
-#ifdef PFB_WITH_IMAGE_ENCRYPTION
-    mbedtls_aes_free(&g_aes_ctx);
-    mbedtls_aes_init(&g_aes_ctx);
-    int ret = mbedtls_aes_setkey_dec(&g_aes_ctx, (const unsigned char*)PFB_AES_KEY,
-                                     strlen(PFB_AES_KEY) * 8);
-    if (ret) {
-        return ret;
+int pfb_get_download_slot_descriptor(pfb_image_descriptor_t *out_descriptor) {
+    return read_slot_descriptor(get_download_slot_start(), out_descriptor);
+}
+
+int pfb_download_slot_crc_audit(void) {
+    return _pfb_crc_table_audit(get_download_slot_start());
+}
+
+static uint32_t get_boot_timings_checksum(const pfb_boot_timings_t *timings) {
+    return get_words_checksum(PFB_BOOT_TIMINGS_MAGIC, timings,
+                              sizeof(*timings));
+}
+
+int pfb_get_boot_timings(pfb_boot_timings_t *out_timings) {
+    const pfb_ram_handoff_t *handoff =
+            (const pfb_ram_handoff_t *) PFB_ADDR_AS_U32(__RAM_HANDOFF_START);
+    if (handoff->magic != PFB_BOOT_TIMINGS_MAGIC
+        || handoff->checksum != get_boot_timings_checksum(&handoff->timings)) {
+        return 1;
     }
-#endif // PFB_WITH_IMAGE_ENCRYPTION
 
+    *out_timings = handoff->timings;
     return 0;
 }
 
@@ -215,17 +1973,42 @@ void pfb_perform_update(void) {
 #ifdef PFB_WITH_IMAGE_ENCRYPTION
     mbedtls_aes_free(&g_aes_ctx);
 #endif // PFB_WITH_IMAGE_ENCRYPTION
+    set_watchdog_flags(PFB_WATCHDOG_FLAG_INSTALL);
     watchdog_enable(1, 1);
     while (1)
         ;
 }
 
+void pfb_perform_recovery(void) {
+    set_watchdog_flags(PFB_WATCHDOG_FLAG_RECOVERY);
+    watchdog_enable(1, 1);
+    while (1)
+        ;
+}
+
+pfb_boot_reason_t pfb_get_boot_reason(void) {
+    if (!is_watchdog_handoff_valid()) {
+        return PFB_BOOT_REASON_POWER_ON;
+    }
+    return (pfb_boot_reason_t) watchdog_hw
+            ->scratch[PFB_WATCHDOG_SCRATCH_BOOT_REASON];
+}
+
+uint32_t pfb_get_boot_count(void) {
+    if (!is_watchdog_handoff_valid()) {
+        return 0;
+    }
+    return watchdog_hw->scratch[PFB_WATCHDOG_SCRATCH_BOOT_COUNT];
+}
+
 void pfb_firmware_commit(void) {
     mark_if_should_rollback(PFB_SHOULD_NOT_ROLLBACK_MAGIC);
+    clear_watchdog_flags(PFB_WATCHDOG_FLAG_ROLLBACK_ARMED);
 }
 
 bool pfb_is_after_rollback(void) {
-    return (__FLASH_INFO_IS_AFTER_ROLLBACK == PFB_IS_AFTER_ROLLBACK_MAGIC);
+    return READ_INFO_FIELD(__FLASH_INFO_IS_AFTER_ROLLBACK)
+           == PFB_IS_AFTER_ROLLBACK_MAGIC;
 }
 
 int pfb_firmware_sha256_check(size_t firmware_size) {
@@ -234,6 +2017,20 @@ int pfb_firmware_sha256_check(size_t firmware_size) {
         return 1;
     }
 
+    uint32_t expected_sha256[PFB_SHA256_DIGEST_SIZE / sizeof(uint32_t)];
+    _pfb_flash_read(get_image_sha256_address(firmware_size), expected_sha256,
+                    PFB_SHA256_DIGEST_SIZE);
+
+#ifndef PFB_WITH_SHA256_REVERIFY
+    // The download has been hashed while it was written, and every page has
+    // been verified against its CRC32, so the flash doesn't have to be read.
+    const unsigned char *download_sha256 = download_sha256_finish(firmware_size);
+    if (download_sha256) {
+        return memcmp(download_sha256, expected_sha256, PFB_SHA256_DIGEST_SIZE)
+               != 0;
+    }
+#endif // PFB_WITH_SHA256_REVERIFY
+
     mbedtls_sha256_context sha256_ctx;
     mbedtls_sha256_init(&sha256_ctx);
 
@@ -243,13 +2040,23 @@ int pfb_firmware_sha256_check(size_t firmware_size) {
         return ret;
     }
 
-    uint32_t image_start_address = PFB_ADDR_AS_U32(__FLASH_DOWNLOAD_SLOT_START);
-    size_t image_size_without_sha256 = firmware_size - 256;
-    ret = mbedtls_sha256_update_ret(&sha256_ctx,
-                                    (const unsigned char *) image_start_address,
-                                    image_size_without_sha256);
-    if (ret) {
-        return ret;
+    uint32_t image_start_address = get_download_slot_start();
+    // The SHA256 covers the image trailer too, see pfb_image_trailer_t.
+    size_t image_size_without_sha256 = firmware_size - PFB_SHA256_DIGEST_SIZE;
+    uint32_t read_buffer[PFB_SHA256_READ_CHUNK_SIZE / sizeof(uint32_t)];
+    for (size_t offset = 0; offset < image_size_without_sha256;
+         offset += sizeof(read_buffer)) {
+        size_t chunk_size = image_size_without_sha256 - offset;
+        if (chunk_size > sizeof(read_buffer)) {
+            chunk_size = sizeof(read_buffer);
+        }
+        _pfb_flash_read(image_start_address + offset, read_buffer, chunk_size);
+        ret = mbedtls_sha256_update_ret(&sha256_ctx,
+                                        (const unsigned char *) read_buffer,
+                                        chunk_size);
+        if (ret) {
+            return ret;
+        }
     }
 
     unsigned char calculated_sha256[PFB_SHA256_DIGEST_SIZE];
@@ -260,8 +2067,7 @@ int pfb_firmware_sha256_check(size_t firmware_size) {
 
     mbedtls_sha256_free(&sha256_ctx);
 
-    void *image_sha256_address = get_image_sha256_address(firmware_size);
-    if (memcmp(calculated_sha256, image_sha256_address, PFB_SHA256_DIGEST_SIZE)
+    if (memcmp(calculated_sha256, expected_sha256, PFB_SHA256_DIGEST_SIZE)
         != 0) {
         return 1;
     }
@@ -284,15 +2090,30 @@ void _pfb_mark_is_not_after_rollback(void) {
 }
 
 bool _pfb_should_rollback(void) {
-    return (__FLASH_INFO_SHOULD_ROLLBACK == PFB_SHOULD_ROLLBACK_MAGIC);
+    return READ_INFO_FIELD(__FLASH_INFO_SHOULD_ROLLBACK)
+           == PFB_SHOULD_ROLLBACK_MAGIC;
+}
+
+uint32_t _pfb_boot_attempts(void) {
+    return READ_INFO_FIELD(__FLASH_INFO_BOOT_ATTEMPTS);
+}
+
+void _pfb_mark_boot_attempts(uint32_t attempts) {
+    set_info_field(PFB_ADDR_AS_U32(__FLASH_INFO_BOOT_ATTEMPTS), attempts);
 }
 
 bool _pfb_has_firmware_to_swap(void) {
-    return (__FLASH_INFO_IS_DOWNLOAD_SLOT_VALID == PFB_SHOULD_SWAP_MAGIC);
+    return READ_INFO_FIELD(__FLASH_INFO_IS_DOWNLOAD_SLOT_VALID)
+           == PFB_SHOULD_SWAP_MAGIC;
 }
 
 uint32_t _pfb_firmware_swap_size(void) {
-    return (__FLASH_INFO_SWAP_SIZE);
+    return READ_INFO_FIELD(__FLASH_INFO_SWAP_SIZE);
+}
+
+bool _pfb_should_install_by_copy(void) {
+    return READ_INFO_FIELD(__FLASH_INFO_INSTALL_MODE)
+           == PFB_INSTALL_MODE_COPY_MAGIC;
 }
 
 
@@ -303,3 +2124,521 @@ void _pfb_mark_pico_has_new_firmware(void) {
 void _pfb_mark_pico_has_no_new_firmware(void) {
     notify_pico_about_firmware(PFB_NO_NEW_FIRMWARE_MAGIC);
 }
+
+static void append_swap_journal_entry(uint16_t entry) {
+    size_t index = swap_journal_first_free_index();
+    // Can't happen, _pfb_swap_journal_begin makes sure a whole swap fits.
+    assert(index < get_swap_journal_capacity());
+
+    uint32_t saved_interrupts = save_and_disable_interrupts();
+    program_within_page_isr_unsafe(
+            get_info_copy_address(PFB_ADDR_AS_U32(__FLASH_INFO_SWAP_JOURNAL))
+                    - XIP_BASE + index * sizeof(entry),
+            &entry, sizeof(entry));
+    restore_interrupts(saved_interrupts);
+}
+
+/**
+ * Opens the swap journal for a new swap of up to @p entry_count entries. The
+ * begin entry holds the length of the info log, so the first flag update after
+ * the swap, i.e. the next info record, is what retires the journal.
+ */
+void _pfb_swap_journal_begin(uint32_t entry_count) {
+    if (swap_journal_first_free_index() + entry_count + 1
+        > get_swap_journal_capacity()) {
+        uint32_t values[PFB_INFO_FIELD_COUNT];
+        load_info_fields(values);
+
+        uint32_t saved_interrupts = save_and_disable_interrupts();
+        compact_info_isr_unsafe(values);
+        restore_interrupts(saved_interrupts);
+    }
+
+    append_swap_journal_entry((uint16_t) ((info_log_first_free_index()
+                                           << PFB_SWAP_JOURNAL_STAGE_BITS)
+                                          | PFB_SWAP_JOURNAL_STAGE_BEGIN));
+}
+
+void _pfb_swap_journal_record(uint32_t sector, uint32_t stage) {
+    append_swap_journal_entry(
+            (uint16_t) ((sector << PFB_SWAP_JOURNAL_STAGE_BITS)
+                        | (stage & PFB_SWAP_JOURNAL_STAGE_MASK)));
+}
+
+/**
+ * Looks up the entry the swap in progress can be resumed from. Entries are
+ * checked in order, each has to be accepted by @p is_next_entry as the one
+ * following the last accepted entry, or stage 0 for the first one. An entry
+ * which isn't accepted has been torn by a power loss, and the swap resumed from
+ * the entry before it, so it's skipped.
+ *
+ * Returns 1 if the swap can be resumed from the last accepted entry, written
+ * to @p out_sector and @p out_stage, 0 if no swap is in progress or nothing has
+ * been recorded yet, and -1 if no entry of the swap in progress is accepted.
+ */
+int _pfb_swap_journal_last(uint32_t *out_sector,
+                           uint32_t *out_stage,
+                           bool (*is_next_entry)(uint32_t prev_sector,
+                                                 uint32_t prev_stage,
+                                                 uint32_t sector,
+                                                 uint32_t stage)) {
+    const uint16_t *journal = get_swap_journal();
+    size_t index = swap_journal_first_free_index();
+    size_t begin_index = index;
+    while (begin_index > 0
+           && (journal[begin_index - 1] & PFB_SWAP_JOURNAL_STAGE_MASK)
+                      != PFB_SWAP_JOURNAL_STAGE_BEGIN) {
+        begin_index--;
+    }
+
+    // No swap has been started, the last one has been retired by an info
+    // record, or nothing has been swapped yet.
+    if (begin_index == 0
+        || (journal[begin_index - 1] >> PFB_SWAP_JOURNAL_STAGE_BITS)
+                   != info_log_first_free_index()
+        || begin_index == index) {
+        return 0;
+    }
+
+    uint32_t sector = 0;
+    uint32_t stage = 0;
+    for (size_t i = begin_index; i < index; i++) {
+        uint32_t entry_sector = journal[i] >> PFB_SWAP_JOURNAL_STAGE_BITS;
+        uint32_t entry_stage = journal[i] & PFB_SWAP_JOURNAL_STAGE_MASK;
+        if (is_next_entry(sector, stage, entry_sector, entry_stage)) {
+            sector = entry_sector;
+            stage = entry_stage;
+        }
+    }
+    if (stage == 0) {
+        return -1;
+    }
+
+    *out_sector = sector;
+    *out_stage = stage;
+    return 1;
+}
+
+void _pfb_crc_table_invalidate(uint32_t slot_start) {
+    uint32_t table_addr = get_crc_table_address(slot_start);
+    // A table without the magic is already invalid, don't wear the sector.
+    if (*(const uint32_t *) table_addr != PFB_CRC_TABLE_MAGIC) {
+        return;
+    }
+
+    // Only the first sector holds the magic, so erasing it is enough.
+    uint32_t saved_interrupts = save_and_disable_interrupts();
+    _pfb_flash_range_erase(table_addr - XIP_BASE, FLASH_SECTOR_SIZE);
+    restore_interrupts(saved_interrupts);
+}
+
+/**
+ * Fills @p words with the sector of the CRC32 table which starts @p offset
+ * bytes into the table. The last sector also gets the descriptor of the image,
+ * if the image has a trailer.
+ */
+static int fill_crc_table_sector(uint32_t slot_start,
+                                 uint32_t size,
+                                 uint32_t install_timestamp,
+                                 uint32_t offset,
+                                 uint32_t words[FLASH_SECTOR_SIZE
+                                                / sizeof(uint32_t)]) {
+    uint32_t sector_count = (size + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+    memset(words, 0xff, FLASH_SECTOR_SIZE);
+    for (uint32_t i = 0; i < FLASH_SECTOR_SIZE / sizeof(uint32_t); i++) {
+        uint32_t word = offset / sizeof(uint32_t) + i;
+        if (word < PFB_CRC_TABLE_HEADER_WORDS) {
+            words[i] = word == 0 ? PFB_CRC_TABLE_MAGIC : sector_count;
+        } else if (word - PFB_CRC_TABLE_HEADER_WORDS < sector_count
+                   && !_pfb_flash_read_crc32(
+                           slot_start
+                                   + (word - PFB_CRC_TABLE_HEADER_WORDS)
+                                             * FLASH_SECTOR_SIZE,
+                           NULL, FLASH_SECTOR_SIZE, &words[i])) {
+            return 1;
+        }
+    }
+
+    const pfb_image_trailer_t *trailer = find_image_trailer(slot_start, size);
+    if (trailer && offset + FLASH_SECTOR_SIZE == get_crc_table_length()) {
+        pfb_slot_descriptor_t *slot_descriptor =
+                (pfb_slot_descriptor_t *) ((uint8_t *) words + FLASH_SECTOR_SIZE
+                                           - sizeof(pfb_slot_descriptor_t));
+        pfb_image_descriptor_t *descriptor = &slot_descriptor->descriptor;
+
+        memset(descriptor, 0, sizeof(*descriptor));
+        descriptor->version = trailer->version;
+        memcpy(descriptor->build_id, trailer->build_id,
+               sizeof(descriptor->build_id));
+        descriptor->size = trailer->image_size + sizeof(*trailer);
+        memcpy(descriptor->digest, trailer->sha256, sizeof(descriptor->digest));
+#ifdef PFB_WITH_IMAGE_ENCRYPTION
+        descriptor->encryption = PFB_IMAGE_ENCRYPTION_AES_ECB;
+#else  // PFB_WITH_IMAGE_ENCRYPTION
+        descriptor->encryption = PFB_IMAGE_ENCRYPTION_NONE;
+#endif // PFB_WITH_IMAGE_ENCRYPTION
+        descriptor->install_timestamp = install_timestamp;
+        slot_descriptor->magic = PFB_IMAGE_DESCRIPTOR_MAGIC;
+        slot_descriptor->checksum =
+                get_words_checksum(PFB_IMAGE_DESCRIPTOR_MAGIC, descriptor,
+                                   sizeof(*descriptor));
+    }
+    return 0;
+}
+
+/**
+ * Stores the CRC32 table of @p size bytes of the slot, together with the
+ * descriptor of the image, if the image has a trailer. The table may take a few
+ * sectors, which are programmed from the last one, so that the magic in the
+ * first one is only there once the rest of the table is.
+ */
+int _pfb_crc_table_store(uint32_t slot_start,
+                         uint32_t size,
+                         uint32_t install_timestamp) {
+    uint32_t words[FLASH_SECTOR_SIZE / sizeof(uint32_t)];
+    uint32_t table_length = get_crc_table_length();
+    if ((size + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE
+        > get_swap_max_length() / FLASH_SECTOR_SIZE) {
+        return 1;
+    }
+
+    uint32_t table_addr_with_xip_offset =
+            get_crc_table_address(slot_start) - XIP_BASE;
+    uint32_t saved_interrupts = save_and_disable_interrupts();
+    _pfb_flash_range_erase(table_addr_with_xip_offset, table_length);
+    restore_interrupts(saved_interrupts);
+
+    for (uint32_t offset = table_length; offset > 0;) {
+        offset -= FLASH_SECTOR_SIZE;
+        // The table is erased, so a failure leaves it without the magic.
+        if (fill_crc_table_sector(slot_start, size, install_timestamp, offset,
+                                  words)) {
+            return 1;
+        }
+
+        saved_interrupts = save_and_disable_interrupts();
+        flash_range_program(table_addr_with_xip_offset + offset,
+                            (const uint8_t *) words, FLASH_SECTOR_SIZE);
+        restore_interrupts(saved_interrupts);
+    }
+    return 0;
+}
+
+uint32_t _pfb_image_install_timestamp(uint32_t slot_start) {
+    pfb_image_descriptor_t descriptor;
+    if (read_slot_descriptor(slot_start, &descriptor)) {
+        return 0;
+    }
+    return descriptor.install_timestamp;
+}
+
+int _pfb_crc_table_audit(uint32_t slot_start) {
+    const uint32_t *table =
+            (const uint32_t *) get_crc_table_address(slot_start);
+    if (table[0] != PFB_CRC_TABLE_MAGIC
+        || table[1] > get_swap_max_length()
+                              / FLASH_SECTOR_SIZE) {
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < table[1]; i++) {
+        uint32_t crc;
+        if (!_pfb_flash_read_crc32(slot_start + i * FLASH_SECTOR_SIZE, NULL,
+                                   FLASH_SECTOR_SIZE, &crc)
+            || crc != table[PFB_CRC_TABLE_HEADER_WORDS + i]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void _pfb_publish_boot_timings(const pfb_boot_timings_t *timings) {
+    // Has to fit in __RAM_HANDOFF_LENGTH bytes.
+    static_assert(sizeof(pfb_ram_handoff_t) <= 256,
+                  "RAM handoff area is too small");
+    pfb_ram_handoff_t *handoff =
+            (pfb_ram_handoff_t *) PFB_ADDR_AS_U32(__RAM_HANDOFF_START);
+
+    handoff->timings = *timings;
+    handoff->checksum = get_boot_timings_checksum(timings);
+    handoff->magic = PFB_BOOT_TIMINGS_MAGIC;
+}
+
+bool _pfb_is_recovery_requested(void) {
+    return is_watchdog_handoff_valid()
+           && (watchdog_hw->scratch[PFB_WATCHDOG_SCRATCH_FLAGS]
+               & PFB_WATCHDOG_FLAG_RECOVERY);
+}
+
+void _pfb_clear_recovery_request(void) {
+    clear_watchdog_flags(PFB_WATCHDOG_FLAG_RECOVERY);
+}
+
+/**
+ * Returns true if the flash info is known to be just as the bootloader left it
+ * during the previous boot, with nothing to install or roll back. It's never
+ * known after a power-on.
+ */
+bool _pfb_is_info_unchanged(void) {
+    return is_watchdog_handoff_valid()
+           && watchdog_hw->scratch[PFB_WATCHDOG_SCRATCH_FLAGS] == 0;
+}
+
+/**
+ * Works out the reason of the current boot. Must be called before
+ * _pfb_publish_boot_status().
+ */
+pfb_boot_reason_t _pfb_boot_reason(void) {
+    if (!is_watchdog_handoff_valid()) {
+        return PFB_BOOT_REASON_POWER_ON;
+    }
+
+    uint32_t flags = watchdog_hw->scratch[PFB_WATCHDOG_SCRATCH_FLAGS];
+    if (flags & PFB_WATCHDOG_FLAG_RECOVERY) {
+        return PFB_BOOT_REASON_RECOVERY;
+    }
+    if (flags & PFB_WATCHDOG_FLAG_INSTALL) {
+        return PFB_BOOT_REASON_UPDATE;
+    }
+    if (watchdog_caused_reboot()) {
+        return PFB_BOOT_REASON_WATCHDOG;
+    }
+    return PFB_BOOT_REASON_RESET;
+}
+
+/**
+ * Leaves the boot status for the application and the next boot. The flash
+ * info is only read if the current boot has touched it, i.e. if
+ * @p is_info_unchanged is false.
+ */
+void _pfb_publish_boot_status(pfb_boot_reason_t reason,
+                              bool is_info_unchanged) {
+    uint32_t boot_count = pfb_get_boot_count();
+    uint32_t flags = 0;
+
+    if (!is_info_unchanged) {
+        if (_pfb_should_rollback()) {
+            flags |= PFB_WATCHDOG_FLAG_ROLLBACK_ARMED;
+        }
+        if (pfb_is_after_firmware_update()) {
+            flags |= PFB_WATCHDOG_FLAG_NEW_FIRMWARE;
+        }
+    }
+    watchdog_hw->scratch[PFB_WATCHDOG_SCRATCH_FLAGS] = flags;
+    watchdog_hw->scratch[PFB_WATCHDOG_SCRATCH_BOOT_COUNT] = boot_count + 1;
+    watchdog_hw->scratch[PFB_WATCHDOG_SCRATCH_BOOT_REASON] = (uint32_t) reason;
+    watchdog_hw->scratch[PFB_WATCHDOG_SCRATCH_MAGIC] = PFB_WATCHDOG_MAGIC;
+}
+
+uint32_t _pfb_download_slot_start(void) {
+    return get_download_slot_start();
+}
+
+#ifdef PFB_WITH_DIRECT_XIP
+uint32_t _pfb_active_slot_start(void) {
+    return get_application_slot_start();
+}
+
+void _pfb_activate_download_slot(void) {
+    mark_inactive_slot_sequence(get_active_slot_sequence() + 1);
+}
+
+void _pfb_invalidate_active_slot(void) {
+    // Never leave the device without a bootable slot.
+    if (is_slot_sequence_valid(get_inactive_slot_sequence())) {
+        mark_active_slot_sequence(PFB_SLOT_SEQUENCE_INVALID);
+    }
+}
+#endif // PFB_WITH_DIRECT_XIP
+
+static const pfb_boot_history_entry_t *
+get_boot_history_sector(uint32_t sector) {
+    return (const pfb_boot_history_entry_t *) (SLOT_TAIL_ADDRESS(
+                                                       __FLASH_BOOT_HISTORY_START)
+                                               + sector * FLASH_SECTOR_SIZE);
+}
+
+static size_t get_boot_history_sector_capacity(void) {
+    return FLASH_SECTOR_SIZE / sizeof(pfb_boot_history_entry_t);
+}
+
+static uint16_t get_boot_history_check(const pfb_boot_history_entry_t *entry) {
+    uint32_t words = entry->sequence ^ entry->duration_us ^ entry->image_version
+                     ^ (uint32_t) (entry->reason | entry->action << 8);
+    return (uint16_t) ~(words ^ (words >> 16));
+}
+
+static bool is_boot_history_entry_valid(const pfb_boot_history_entry_t *entry) {
+    return entry->sequence != PFB_BOOT_HISTORY_ERASED_SEQUENCE
+           && entry->check == get_boot_history_check(entry);
+}
+
+/**
+ * Returns the index of the last valid entry of the boot history @p sector, or
+ * -1 if it has none.
+ */
+static int find_last_boot_history_entry(uint32_t sector) {
+    const pfb_boot_history_entry_t *entries = get_boot_history_sector(sector);
+    for (int i = (int) get_boot_history_sector_capacity() - 1; i >= 0; i--) {
+        if (is_boot_history_entry_valid(&entries[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Returns the sector of the boot history which holds the newest entry.
+ */
+static uint32_t get_newest_boot_history_sector(void) {
+    int last[2] = {find_last_boot_history_entry(0),
+                   find_last_boot_history_entry(1)};
+    if (last[1] < 0) {
+        return 0;
+    }
+    if (last[0] < 0) {
+        return 1;
+    }
+    return (int32_t) (get_boot_history_sector(1)[last[1]].sequence
+                      - get_boot_history_sector(0)[last[0]].sequence)
+                           > 0
+                   ? 1
+                   : 0;
+}
+
+size_t pfb_get_boot_history(pfb_boot_record_t *out_records, size_t max_count) {
+    uint32_t newest_sector = get_newest_boot_history_sector();
+    size_t count = 0;
+
+    for (uint32_t i = 0; i < 2; i++) {
+        uint32_t sector = i == 0 ? newest_sector : 1 - newest_sector;
+        const pfb_boot_history_entry_t *entries =
+                get_boot_history_sector(sector);
+        for (int j = find_last_boot_history_entry(sector);
+             j >= 0 && count < max_count; j--) {
+            if (!is_boot_history_entry_valid(&entries[j])) {
+                continue;
+            }
+            out_records[count].sequence = entries[j].sequence;
+            out_records[count].reason = (pfb_boot_reason_t) entries[j].reason;
+            out_records[count].action = (pfb_boot_action_t) entries[j].action;
+            out_records[count].duration_us = entries[j].duration_us;
+            out_records[count].image_version = entries[j].image_version;
+            count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * Appends a record of the current boot to the boot history. Once the sector
+ * of the newest entry is full, the other sector is erased and used instead.
+ */
+void _pfb_boot_history_append(pfb_boot_reason_t reason,
+                              pfb_boot_action_t action,
+                              uint32_t duration_us) {
+    uint32_t sector = get_newest_boot_history_sector();
+    int last = find_last_boot_history_entry(sector);
+    const pfb_boot_history_entry_t *entries = get_boot_history_sector(sector);
+    pfb_image_descriptor_t descriptor;
+
+    pfb_boot_history_entry_t entry = {
+        .sequence = last < 0 ? 1 : entries[last].sequence + 1,
+        .reason = (uint8_t) reason,
+        .action = (uint8_t) action,
+        .duration_us = duration_us,
+        .image_version = pfb_get_application_slot_descriptor(&descriptor)
+                                 ? 0
+                                 : descriptor.version,
+    };
+    entry.check = get_boot_history_check(&entry);
+
+    // Entries torn by a power loss are skipped, as programming over them
+    // could make them look valid.
+    size_t index = (size_t) (last + 1);
+    while (index < get_boot_history_sector_capacity()
+           && entries[index].sequence != PFB_BOOT_HISTORY_ERASED_SEQUENCE) {
+        index++;
+    }
+
+    uint32_t saved_interrupts = save_and_disable_interrupts();
+    if (index == get_boot_history_sector_capacity()) {
+        sector = 1 - sector;
+        index = 0;
+        _pfb_flash_range_erase((uint32_t) get_boot_history_sector(sector)
+                                       - XIP_BASE,
+                               FLASH_SECTOR_SIZE);
+    }
+    program_within_page_isr_unsafe(
+            (uint32_t) &get_boot_history_sector(sector)[index] - XIP_BASE,
+            &entry, sizeof(entry));
+    restore_interrupts(saved_interrupts);
+}
+
+void pfb_get_erase_counters(pfb_erase_counters_t *out_counters) {
+    uint32_t counts[PFB_ERASE_REGION_COUNT];
+    load_erase_counts(counts);
+
+    out_counters->info_sector = counts[PFB_ERASE_REGION_INFO];
+    memcpy(out_counters->application_slot,
+           &counts[PFB_ERASE_REGION_APPLICATION_SLOT],
+           sizeof(out_counters->application_slot));
+    memcpy(out_counters->download_slot,
+           &counts[PFB_ERASE_REGION_DOWNLOAD_SLOT],
+           sizeof(out_counters->download_slot));
+}
+
+void pfb_get_wear_stats(pfb_wear_stats_t *out_stats) {
+    uint32_t counts[PFB_ERASE_REGION_COUNT];
+    load_erase_counts(counts);
+
+    uint32_t max_count = 0;
+    for (int region = 0; region < PFB_ERASE_REGION_COUNT; region++) {
+        if (counts[region] > max_count) {
+            max_count = counts[region];
+        }
+    }
+
+    out_stats->endurance = PFB_FLASH_ERASE_ENDURANCE;
+    out_stats->max_erase_count = max_count;
+    out_stats->remaining_erases = max_count < PFB_FLASH_ERASE_ENDURANCE
+                                          ? PFB_FLASH_ERASE_ENDURANCE
+                                                    - max_count
+                                          : 0;
+    out_stats->used_permille =
+            (uint32_t) ((uint64_t) max_count * 1000 / PFB_FLASH_ERASE_ENDURANCE);
+}
+
+int pfb_get_partition(pfb_partition_type_t type, pfb_partition_t *out_partition) {
+    const pfb_partition_t *layout = get_layout();
+    if (type >= PFB_PARTITION_TYPE_COUNT
+        || !(g_layout.present_partitions & (1u << type))) {
+        return 1;
+    }
+    *out_partition = layout[type];
+    return 0;
+}
+
+uint32_t _pfb_app_partition_start(void) {
+    return get_app_partition_start();
+}
+
+uint32_t _pfb_download_partition_start(void) {
+    return get_download_partition_start();
+}
+
+uint32_t _pfb_swap_max_length(void) {
+    return get_swap_max_length();
+}
+
+uint32_t _pfb_swap_scratch_start(void) {
+    return get_download_partition_start() + get_swap_max_length();
+}
+
+uint32_t pfb_get_flash_size(void) {
+    return get_flash_size();
+}
+
+bool _pfb_is_layout_in_flash(void) {
+    return is_layout_in_flash();
+}